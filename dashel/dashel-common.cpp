@@ -43,6 +43,12 @@
 #include "dashel.h"
 #include "dashel-private.h"
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <new>
 
 #include <ostream>
 #include <sstream>
@@ -66,7 +72,7 @@ namespace Dashel
 
 	// frome dashe-private.h
 	ExpandableBuffer::ExpandableBuffer(size_t size) :
-		_data((unsigned char*)malloc(size)),
+		_data(size ? (unsigned char*)malloc(size) : 0),
 		_size(size),
 		_pos(0)
 	{
@@ -82,6 +88,15 @@ namespace Dashel
 		_pos = 0;
 	}
 
+	void ExpandableBuffer::release()
+	{
+		free(_data);
+		_data = 0;
+		_size = 0;
+		_pos = 0;
+	}
+
+
 	void ExpandableBuffer::add(const void* data, const size_t size)
 	{
 		if (_pos + size > _size)
@@ -93,6 +108,67 @@ namespace Dashel
 		_pos += size;
 	}
 
+	const size_t SegmentedBuffer::SEGMENT_CAPACITY;
+
+	SegmentedBuffer::SegmentedBuffer() :
+		head(0),
+		tail(0),
+		_size(0),
+		allocator(0)
+	{
+	}
+
+	SegmentedBuffer::~SegmentedBuffer()
+	{
+		clear();
+	}
+
+	void SegmentedBuffer::setAllocator(SegmentAllocator* allocator)
+	{
+		assert(head == 0);
+		this->allocator = allocator;
+	}
+
+	void SegmentedBuffer::add(const void* data, size_t size)
+	{
+		const unsigned char* ptr = (const unsigned char*)data;
+		_size += size;
+		while (size)
+		{
+			if (!tail || tail->size == SEGMENT_CAPACITY)
+			{
+				Segment* segment = static_cast<Segment*>(allocator ? allocator->allocateSegment() : ::operator new(SEGMENT_SIZE));
+				segment->next = 0;
+				segment->size = 0;
+				if (tail)
+					tail->next = segment;
+				else
+					head = segment;
+				tail = segment;
+			}
+			const size_t chunk = min(size, SEGMENT_CAPACITY - tail->size);
+			memcpy(tail->data() + tail->size, ptr, chunk);
+			tail->size += chunk;
+			ptr += chunk;
+			size -= chunk;
+		}
+	}
+
+	void SegmentedBuffer::clear()
+	{
+		while (head)
+		{
+			Segment* next = head->next;
+			if (allocator)
+				allocator->deallocateSegment(head);
+			else
+				::operator delete(head);
+			head = next;
+		}
+		tail = 0;
+		_size = 0;
+	}
+
 	// to be removed when we switch to C++11
 	string _to_string(int se)
 	{
@@ -133,6 +209,62 @@ namespace Dashel
 			return sourceNames[s];
 	}
 
+	//! The shared data of a SharedBuffer, allocated along with the data that follow it
+	struct SharedBuffer::Block
+	{
+		std::atomic<unsigned> refCount; //!< number of SharedBuffer sharing this block
+		size_t size; //!< size of the data following this block
+	};
+
+	SharedBuffer::SharedBuffer() :
+		block(0)
+	{
+	}
+
+	SharedBuffer::SharedBuffer(const void* data, size_t size)
+	{
+		void* memory = malloc(sizeof(Block) + size);
+		if (!memory)
+			throw std::bad_alloc();
+		block = new (memory) Block;
+		block->refCount = 1;
+		block->size = size;
+		memcpy(reinterpret_cast<unsigned char*>(block + 1), data, size);
+	}
+
+	SharedBuffer::SharedBuffer(const SharedBuffer& that) :
+		block(that.block)
+	{
+		if (block)
+			++block->refCount;
+	}
+
+	SharedBuffer& SharedBuffer::operator=(const SharedBuffer& that)
+	{
+		SharedBuffer copy(that);
+		std::swap(block, copy.block);
+		return *this;
+	}
+
+	SharedBuffer::~SharedBuffer()
+	{
+		if (block && --block->refCount == 0)
+		{
+			block->~Block();
+			free(block);
+		}
+	}
+
+	const unsigned char* SharedBuffer::data() const
+	{
+		return block ? (const unsigned char*)(block + 1) : 0;
+	}
+
+	size_t SharedBuffer::size() const
+	{
+		return block ? block->size : 0;
+	}
+
 	IPV4Address::IPV4Address(unsigned addr, unsigned short prt) :
 		address(addr),
 		port(prt) {}
@@ -220,64 +352,180 @@ namespace Dashel
 		return buf.str();
 	}
 
+	const ParameterSet::Entry* ParameterSet::find(const char* key, size_t keyLength) const
+	{
+		for (std::vector<Entry>::const_iterator it = entries.begin(); it != entries.end(); ++it)
+			if (it->key.size() == keyLength && memcmp(it->key.data(), key, keyLength) == 0)
+				return &*it;
+		return 0;
+	}
+
+	ParameterSet::Entry& ParameterSet::findOrAppend(const char* key, size_t keyLength)
+	{
+		const Entry* entry(find(key, keyLength));
+		if (entry)
+			return const_cast<Entry&>(*entry);
+		entries.push_back(Entry());
+		entries.back().key.assign(key, keyLength);
+		entries.back().listed = false;
+		return entries.back();
+	}
+
 	void ParameterSet::add(const char* line)
 	{
-		char* lc = strdup(line);
-		int spc = 0;
-		char* param;
-		bool storeParams = (params.size() == 0);
-		char* protocolName = strtok(lc, ":");
+		// the protocol name is ignored
+		const char* param = strchr(line, ':');
+		if (!param)
+			return;
+		++param;
 
-		// Do nothing with this.
-		assert(protocolName);
+		bool storeParams = true;
+		for (size_t i = 0; i < entries.size(); ++i)
+			if (entries[i].listed)
+				storeParams = false;
 
-		while ((param = strtok(NULL, ";")) != NULL)
+		size_t spc = 0;
+		while (*param)
 		{
-			char* sep = strchr(param, '=');
+			const char* end = strchr(param, ';');
+			if (!end)
+				end = param + strlen(param);
+			if (end == param)
+			{
+				++param;
+				continue;
+			}
+
+			const char* sep = (const char*)memchr(param, '=', end - param);
 			if (sep)
 			{
-				*sep++ = 0;
-				values[param] = sep;
+				Entry& entry(findOrAppend(param, sep - param));
+				entry.value.assign(sep + 1, end);
 				if (storeParams)
-					params.push_back(param);
+					entry.listed = true;
+			}
+			else if (storeParams)
+			{
+				Entry& entry(findOrAppend(param, end - param));
+				entry.value = entry.key;
+				entry.listed = true;
 			}
 			else
 			{
-				if (storeParams)
-					params.push_back(param);
-				values[params[spc]] = param;
+				// set the value of the spc-th listed parameter
+				size_t listedIndex = 0;
+				std::vector<Entry>::iterator it = entries.begin();
+				for (; it != entries.end(); ++it)
+					if (it->listed && listedIndex++ == spc)
+						break;
+				if (it == entries.end())
+					throw DashelException(DashelException::InvalidTarget, 0, "Too many parameters in target.");
+				it->value.assign(param, end);
 			}
 			++spc;
+			param = *end ? end + 1 : end;
 		}
-
-		free(lc);
 	}
 
 	void ParameterSet::addParam(const char* param, const char* value, bool atStart)
 	{
+		Entry entry;
+		entry.key = param;
+		entry.listed = true;
+
+		// an existing parameter is moved, keeping its value if none is given
+		for (std::vector<Entry>::iterator it = entries.begin(); it != entries.end(); ++it)
+		{
+			if (it->key == param)
+			{
+				entry.value.swap(it->value);
+				entries.erase(it);
+				break;
+			}
+		}
+		if (value)
+			entry.value = value;
+
 		if (atStart)
-			params.insert(params.begin(), 1, param);
+			entries.insert(entries.begin(), entry);
 		else
-			params.push_back(param);
+			entries.push_back(entry);
+	}
 
-		if (value)
-			values[param] = value;
+	void ParameterSet::setValue(const char* key, const std::string& value)
+	{
+		findOrAppend(key, strlen(key)).value = value;
 	}
 
 	bool ParameterSet::isSet(const char* key) const
 	{
-		return (values.find(key) != values.end());
+		return find(key, strlen(key)) != 0;
 	}
 
 	const std::string& ParameterSet::get(const char* key) const
 	{
-		std::map<std::string, std::string>::const_iterator it = values.find(key);
-		if (it == values.end())
+		const Entry* entry(find(key, strlen(key)));
+		if (!entry)
 		{
 			std::string r = std::string("Parameter missing: ").append(key);
 			throw DashelException(DashelException::InvalidTarget, 0, r.c_str());
 		}
-		return it->second;
+		return entry->value;
+	}
+
+	bool parseParameter(const std::string& value, bool& result)
+	{
+		if (value == "true" || value == "1")
+			result = true;
+		else if (value == "false" || value == "0")
+			result = false;
+		else
+			return false;
+		return true;
+	}
+
+	//! Parse an integer with strtoll or strtoull, return false if value does not start with a number or if the number does not fit in T
+	template<typename T, typename U>
+	static bool parseInteger(const std::string& value, T& result, U (*convert)(const char*, char**, int))
+	{
+		const char* begin(value.c_str());
+		// strtoull accepts negative numbers and wraps them around
+		const size_t sign(value.find_first_not_of(" \t\n\v\f\r"));
+		if (!std::numeric_limits<T>::is_signed && sign != std::string::npos && value[sign] == '-')
+			return false;
+		char* end;
+		errno = 0;
+		const U parsed(convert(begin, &end, 10));
+		if (end == begin || errno == ERANGE)
+			return false;
+		if (parsed < static_cast<U>(std::numeric_limits<T>::min()) || parsed > static_cast<U>(std::numeric_limits<T>::max()))
+			return false;
+		result = static_cast<T>(parsed);
+		return true;
+	}
+
+	bool parseParameter(const std::string& value, int& result) { return parseInteger(value, result, &strtoll); }
+	bool parseParameter(const std::string& value, unsigned& result) { return parseInteger(value, result, &strtoull); }
+	bool parseParameter(const std::string& value, long& result) { return parseInteger(value, result, &strtoll); }
+	bool parseParameter(const std::string& value, unsigned long& result) { return parseInteger(value, result, &strtoull); }
+	bool parseParameter(const std::string& value, long long& result) { return parseInteger(value, result, &strtoll); }
+	bool parseParameter(const std::string& value, unsigned long long& result) { return parseInteger(value, result, &strtoull); }
+
+	bool parseParameter(const std::string& value, double& result)
+	{
+		const char* begin(value.c_str());
+		char* end;
+		result = strtod(begin, &end);
+		return end != begin;
+	}
+
+	bool parseParameter(const std::string& value, float& result)
+	{
+		double parsed;
+		if (!parseParameter(value, parsed))
+			return false;
+		result = static_cast<float>(parsed);
+		return true;
 	}
 
 	// explicit template instanciation of get() for int, unsigned, float and double
@@ -289,50 +537,808 @@ namespace Dashel
 
 	std::string ParameterSet::getString() const
 	{
-		std::ostringstream oss;
-		std::vector<std::string>::const_iterator i = params.begin();
-		while (i != params.end())
+		std::string result;
+		for (std::vector<Entry>::const_iterator it = entries.begin(); it != entries.end(); ++it)
 		{
-			oss << *i << "=" << values.find(*i)->second;
-			if (++i == params.end())
-				break;
-			oss << ";";
+			if (!it->listed)
+				continue;
+			if (!result.empty())
+				result += ';';
+			result += it->key;
+			result += '=';
+			result += it->value;
 		}
-		return oss.str();
+		return result;
 	}
 
 	void ParameterSet::erase(const char* key)
 	{
-		std::vector<std::string>::iterator i = std::find(params.begin(), params.end(), key);
-		if (i != params.end())
-			params.erase(i);
+		for (std::vector<Entry>::iterator it = entries.begin(); it != entries.end(); ++it)
+		{
+			if (it->key == key)
+			{
+				entries.erase(it);
+				return;
+			}
+		}
+	}
+
+
+	MessageFramer* MessageFramer::create(const ParameterSet& target)
+	{
+		if (!target.isSet("framing") || target.get("framing") == "none")
+			return 0;
+		return new MessageFramer(target);
+	}
+
+	MessageFramer::MessageFramer(const ParameterSet& target) :
+		delimiter(0),
+		pendingDelivered(false),
+		chunk(0),
+		chunkSize(0)
+	{
+		const std::string& framing(target.get("framing"));
+		if (framing == "u8")
+			mode = LengthU8, lengthSize = 1;
+		else if (framing == "u16le")
+			mode = LengthU16LE, lengthSize = 2;
+		else if (framing == "u16be")
+			mode = LengthU16BE, lengthSize = 2;
+		else if (framing == "u32le")
+			mode = LengthU32LE, lengthSize = 4;
+		else if (framing == "u32be")
+			mode = LengthU32BE, lengthSize = 4;
+		else if (framing == "varint")
+			mode = LengthVarint, lengthSize = 0;
+		else if (framing == "line")
+			mode = Lines, lengthSize = 0, delimiter = '\n';
+		else if (framing == "delim")
+			mode = Delimited, lengthSize = 0, delimiter = parseDelimiter(target.get("framingDelim"));
+		else
+			throw DashelException(DashelException::InvalidTarget, 0, "Invalid framing mode, must be none, u8, u16le, u16be, u32le, u32be, varint, line, or delim.");
+
+		headerSize = target.isSet("framingHeader") ? target.get<unsigned>("framingHeader") : lengthSize;
+		lengthOffset = target.isSet("framingOffset") ? target.get<unsigned>("framingOffset") : 0;
+		lengthInclusive = target.isSet("framingInclusive") ? target.get<bool>("framingInclusive") : false;
+		maxSize = target.isSet("framingMax") ? target.get<unsigned>("framingMax") : 16777216;
+
+		if (lengthSize == 0 && (headerSize != 0 || lengthOffset != 0))
+			throw DashelException(DashelException::InvalidTarget, 0, "This framing mode does not support a header layout.");
+		if (lengthOffset + lengthSize > headerSize)
+			throw DashelException(DashelException::InvalidTarget, 0, "Framing length field does not fit in header.");
+	}
+
+	unsigned char MessageFramer::parseDelimiter(const std::string& value)
+	{
+		if (value.size() == 1)
+			return value[0];
+		if (value == "\\n")
+			return '\n';
+		if (value == "\\r")
+			return '\r';
+		if (value == "\\t")
+			return '\t';
+		if (value == "\\0")
+			return 0;
+		if (value.size() == 4 && value[0] == '0' && (value[1] == 'x' || value[1] == 'X'))
+		{
+			char* end;
+			const unsigned long code(strtoul(value.c_str() + 2, &end, 16));
+			if (*end == 0)
+				return (unsigned char)code;
+		}
+		throw DashelException(DashelException::InvalidTarget, 0, "Invalid framing delimiter, must be a single character, \\n, \\r, \\t, \\0, or 0xNN.");
+	}
+
+	void Stream::writeShared(const SharedBuffer& buffer)
+	{
+		write(buffer.data(), buffer.size());
+	}
+
+	size_t Stream::readSome(void* data, size_t size)
+	{
+		fail(DashelException::InvalidOperation, 0, "This stream type does not support non-blocking reads.");
+		return 0;
+	}
+
+	//! Clear a flag during the lifetime of this object, restoring its value even if an exception is thrown
+	class ScopedFlagClear
+	{
+	private:
+		bool& flag; //!< the flag to clear
+		const bool previous; //!< the value to restore
+
+	public:
+		//! Clear flag
+		explicit ScopedFlagClear(bool& flag) :
+			flag(flag),
+			previous(flag)
+		{
+			flag = false;
+		}
+		//! Restore flag
+		~ScopedFlagClear() { flag = previous; }
+	};
+
+	//! Return the status corresponding to the state of stream
+	static Stream::Status streamStatus(const Stream* stream)
+	{
+		if (!stream->failed())
+			return Stream::StatusOk;
+		return stream->getFailSource() == DashelException::ConnectionLost ? Stream::StatusClosed : Stream::StatusFailed;
+	}
+
+	Stream::Status Stream::tryWrite(const void* data, size_t size)
+	{
+		if (!failedFlag)
+		{
+			ScopedFlagClear quiet(throwOnFailure);
+			write(data, size);
+		}
+		return streamStatus(this);
+	}
+
+	Stream::Status Stream::tryFlush()
+	{
+		if (!failedFlag)
+		{
+			ScopedFlagClear quiet(throwOnFailure);
+			flush();
+		}
+		return streamStatus(this);
+	}
+
+	Stream::Status Stream::tryRead(void* data, size_t size)
+	{
+		if (!failedFlag)
+		{
+			ScopedFlagClear quiet(throwOnFailure);
+			read(data, size);
+		}
+		return streamStatus(this);
+	}
 
-		std::map<std::string, std::string>::iterator j = values.find(key);
-		if (j != values.end())
-			values.erase(j);
+	Stream::Status Stream::tryReadSome(void* data, size_t size, size_t& readSize)
+	{
+		readSize = 0;
+		if (!failedFlag)
+		{
+			ScopedFlagClear quiet(throwOnFailure);
+			readSize = readSome(data, size);
+		}
+		return streamStatus(this);
 	}
 
+	void MessageFramer::push(const unsigned char* data, size_t size)
+	{
+		chunk = data;
+		chunkSize = size;
+	}
+
+	bool MessageFramer::next(Stream* stream, const unsigned char*& message, size_t& size)
+	{
+		// the frame returned by the last call is not needed any more
+		if (pendingDelivered)
+		{
+			pending.clear();
+			pendingDelivered = false;
+		}
+
+		// complete a record that started in previously pushed data, that does not contain the delimiter
+		if (pending.size() > 0 && isDelimited())
+		{
+			const unsigned char* end((const unsigned char*)memchr(chunk, delimiter, chunkSize));
+			const size_t toCopy(end ? end - chunk + 1 : chunkSize);
+			pending.add(chunk, toCopy);
+			chunk += toCopy;
+			chunkSize -= toCopy;
+			if (pending.size() > maxSize)
+			{
+				stream->fail(DashelException::IOError, 0, "Message too large.");
+				return false;
+			}
+			if (!end)
+				return false;
+			extract(pending.get(), pending.size(), message, size);
+			pendingDelivered = true;
+			return true;
+		}
+
+		// complete a frame that started in previously pushed data
+		while (pending.size() > 0)
+		{
+			size_t needed;
+			const size_t frame(frameSize(stream, pending.get(), pending.size(), needed));
+			if (stream->failed())
+				return false;
+			if (frame && pending.size() == frame)
+			{
+				extract(pending.get(), frame, message, size);
+				pendingDelivered = true;
+				return true;
+			}
+			if (frame)
+				needed = frame;
+			const size_t toCopy(std::min(needed - pending.size(), chunkSize));
+			if (toCopy == 0)
+				return false;
+			pending.add(chunk, toCopy);
+			chunk += toCopy;
+			chunkSize -= toCopy;
+		}
+
+		if (chunkSize == 0)
+			return false;
+
+		// return frames lying entirely within pushed data in place
+		size_t needed;
+		const size_t frame(frameSize(stream, chunk, chunkSize, needed));
+		if (stream->failed())
+			return false;
+		if (frame && frame <= chunkSize)
+		{
+			extract(chunk, frame, message, size);
+			chunk += frame;
+			chunkSize -= frame;
+			return true;
+		}
+
+		// keep the beginning of the frame for later
+		pending.add(chunk, chunkSize);
+		chunk += chunkSize;
+		chunkSize = 0;
+		return false;
+	}
+
+	size_t MessageFramer::frameSize(Stream* stream, const unsigned char* data, size_t size, size_t& needed) const
+	{
+		size_t length(0);
+		size_t header(headerSize);
+		if (isDelimited())
+		{
+			// memchr is vectorized by the C library
+			const unsigned char* end((const unsigned char*)memchr(data, delimiter, size));
+			if (!end)
+			{
+				if (size >= maxSize)
+				{
+					stream->fail(DashelException::IOError, 0, "Message too large.");
+					return 0;
+				}
+				needed = size + 1;
+				return 0;
+			}
+			length = end - data + 1;
+			header = 0;
+		}
+		else if (mode == LengthVarint)
+		{
+			const size_t lastByte((sizeof(size_t) * 8 + 6) / 7 - 1);
+			size_t i(0);
+			for (; i < size; ++i)
+			{
+				// the last byte must end the length, and hold no bits beyond those of size_t
+				if (i == lastByte && (data[i] >> (sizeof(size_t) * 8 - 7 * lastByte)) != 0)
+				{
+					stream->fail(DashelException::IOError, 0, "Invalid variable-length message size.");
+					return 0;
+				}
+				length |= size_t(data[i] & 0x7f) << (7 * i);
+				if ((data[i] & 0x80) == 0)
+					break;
+			}
+			if (i == size)
+			{
+				needed = size + 1;
+				return 0;
+			}
+			header = i + 1;
+		}
+		else
+		{
+			if (size < headerSize)
+			{
+				needed = headerSize;
+				return 0;
+			}
+			const unsigned char* p(data + lengthOffset);
+			switch (mode)
+			{
+				case LengthU8: length = p[0]; break;
+				case LengthU16LE: length = size_t(p[0]) | (size_t(p[1]) << 8); break;
+				case LengthU16BE: length = (size_t(p[0]) << 8) | size_t(p[1]); break;
+				case LengthU32LE: length = size_t(p[0]) | (size_t(p[1]) << 8) | (size_t(p[2]) << 16) | (size_t(p[3]) << 24); break;
+				case LengthU32BE: length = (size_t(p[0]) << 24) | (size_t(p[1]) << 16) | (size_t(p[2]) << 8) | size_t(p[3]); break;
+				default: assert(false);
+			}
+		}
+
+		const size_t frame(lengthInclusive ? length : header + length);
+		if (frame < header)
+		{
+			stream->fail(DashelException::IOError, 0, "Message size smaller than its header.");
+			return 0;
+		}
+		if (frame > maxSize)
+		{
+			stream->fail(DashelException::IOError, 0, "Message too large.");
+			return 0;
+		}
+		return frame;
+	}
+
+	void MessageFramer::extract(const unsigned char* frame, size_t frameSize, const unsigned char*& message, size_t& size) const
+	{
+		if (isDelimited())
+		{
+			// pass the record without its delimiter, and for lines without \r either
+			message = frame;
+			size = frameSize - 1;
+			if (mode == Lines && size > 0 && frame[size - 1] == '\r')
+				--size;
+			return;
+		}
+
+		// with a plain length prefix, only pass the payload; with a header layout, pass the whole frame
+		size_t skip(0);
+		if (headerSize == lengthSize)
+		{
+			skip = lengthSize;
+			if (mode == LengthVarint)
+				while (frame[skip++] & 0x80)
+					;
+		}
+		message = frame + skip;
+		size = frameSize - skip;
+	}
 
 	void MemoryPacketStream::write(const void* data, const size_t size)
 	{
+		DASHEL_STAT(++statistics.writeCalls; statistics.bytesOut += size);
 		sendBuffer.add(data, size);
 	}
 
 	void MemoryPacketStream::read(void* data, size_t size)
 	{
-		if (size > receptionBuffer.size())
+		if (size > receptionBuffer.size() - receptionPos)
+		{
 			fail(DashelException::IOError, 0, "Attempt to read past available data");
+			return;
+		}
+
+		DASHEL_STAT(++statistics.readCalls; statistics.bytesIn += size);
+
+		if (size)
+			memcpy(data, &receptionBuffer[receptionPos], size);
+		receptionPos += size;
+	}
+
+	void PacketStream::sendSegmented(const IPV4Address& dest, size_t segmentSize)
+	{
+		fail(DashelException::InvalidOperation, 0, "This stream type does not support sending segmented packets.");
+	}
+
+	void MemoryPacketStream::sendSegmented(const IPV4Address& dest, size_t segmentSize)
+	{
+		if (segmentSize == 0 || sendBuffer.size() <= segmentSize)
+		{
+			send(dest);
+			return;
+		}
+
+		// send a copy of the written data through send(), one segment at a time
+		const std::vector<unsigned char> data(sendBuffer.get(), sendBuffer.get() + sendBuffer.size());
+		for (size_t pos = 0; pos < data.size(); pos += segmentSize)
+		{
+			sendBuffer.clear();
+			sendBuffer.add(&data[pos], std::min(segmentSize, data.size() - pos));
+			send(dest);
+		}
+	}
+
+	size_t MemoryPacketStream::readSome(void* data, size_t size)
+	{
+		size = std::min(size, receptionBuffer.size() - receptionPos);
+		read(data, size);
+		return size;
+	}
+
+	// Serialization
+
+	void swapByteOrder(void* dest, const void* src, size_t elementSize, size_t count)
+	{
+		unsigned char* d = (unsigned char*)dest;
+		const unsigned char* s = (const unsigned char*)src;
+
+		// values are loaded and stored with memcpy, as arrays of bytes may not be aligned
+		switch (elementSize)
+		{
+			case 1:
+				if (d != s)
+					memcpy(d, s, count);
+				break;
+
+			case 2:
+				for (size_t i = 0; i < count; ++i)
+				{
+					uint16_t v;
+					memcpy(&v, s + i * 2, 2);
+					v = uint16_t((v >> 8) | (v << 8));
+					memcpy(d + i * 2, &v, 2);
+				}
+				break;
+
+			case 4:
+				for (size_t i = 0; i < count; ++i)
+				{
+					uint32_t v;
+					memcpy(&v, s + i * 4, 4);
+					v = (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+					memcpy(d + i * 4, &v, 4);
+				}
+				break;
+
+			case 8:
+				for (size_t i = 0; i < count; ++i)
+				{
+					uint64_t v;
+					memcpy(&v, s + i * 8, 8);
+					v = ((v & 0x00000000000000ffull) << 56) | ((v & 0x000000000000ff00ull) << 40) |
+						((v & 0x0000000000ff0000ull) << 24) | ((v & 0x00000000ff000000ull) << 8) |
+						((v & 0x000000ff00000000ull) >> 8) | ((v & 0x0000ff0000000000ull) >> 24) |
+						((v & 0x00ff000000000000ull) >> 40) | ((v & 0xff00000000000000ull) >> 56);
+					memcpy(d + i * 8, &v, 8);
+				}
+				break;
+
+			default:
+				for (size_t i = 0; i < count; ++i)
+				{
+					unsigned char* de = d + i * elementSize;
+					const unsigned char* se = s + i * elementSize;
+					// swap pairs of bytes, so that converting in place works
+					for (size_t j = 0; j < (elementSize + 1) / 2; ++j)
+					{
+						const unsigned char first = se[j];
+						const unsigned char last = se[elementSize - 1 - j];
+						de[j] = last;
+						de[elementSize - 1 - j] = first;
+					}
+				}
+				break;
+		}
+	}
+
+	StreamWriter::StreamWriter(Stream* stream, ByteOrder order) :
+		stream(stream),
+		swap(order != hostByteOrder()),
+		buffer(0),
+		_size(0),
+		capacity(0)
+	{
+	}
+
+	StreamWriter::~StreamWriter()
+	{
+		free(buffer);
+	}
+
+	void StreamWriter::flush()
+	{
+		if (_size == 0)
+			return;
+		// empty the buffer first, so that a failing stream does not leave the data to be written again
+		const size_t size(_size);
+		_size = 0;
+		stream->write(buffer, size);
+	}
+
+	unsigned char* StreamWriter::grow(size_t size)
+	{
+		const size_t newCapacity(max(capacity * 2, max(_size + size, size_t(256))));
+		unsigned char* newBuffer = (unsigned char*)realloc(buffer, newCapacity);
+		if (!newBuffer)
+			throw std::bad_alloc();
+		buffer = newBuffer;
+		capacity = newCapacity;
+		return buffer + _size;
+	}
+
+	StreamReader::StreamReader(Stream* stream, ByteOrder order) :
+		stream(stream),
+		swap(order != hostByteOrder()),
+		data(0),
+		pos(0),
+		_size(0),
+		buffer(0),
+		capacity(0)
+	{
+	}
+
+	StreamReader::StreamReader(const void* data, size_t size, ByteOrder order, Stream* stream) :
+		stream(stream),
+		swap(order != hostByteOrder()),
+		data((const unsigned char*)data),
+		pos(0),
+		_size(size),
+		buffer(0),
+		capacity(0)
+	{
+	}
+
+	StreamReader::~StreamReader()
+	{
+		free(buffer);
+	}
+
+	void StreamReader::fill(size_t size)
+	{
+		assert(stream);
+		if (size > capacity)
+		{
+			unsigned char* newBuffer = (unsigned char*)realloc(buffer, size);
+			if (!newBuffer)
+				throw std::bad_alloc();
+			buffer = newBuffer;
+			capacity = size;
+		}
+		// the previous data are dropped before reading, so that they are not decoded again if the read fails
+		data = buffer;
+		pos = 0;
+		_size = 0;
+		stream->read(buffer, size);
+		_size = size;
+	}
+
+	void StreamReader::reset(const void* data, size_t size)
+	{
+		this->data = (const unsigned char*)data;
+		pos = 0;
+		_size = size;
+	}
+
+	void StreamReader::underflow() const
+	{
+		if (stream)
+			stream->fail(DashelException::IOError, 0, "Attempt to read past the end of the data.");
+		throw DashelException(DashelException::IOError, 0, "Attempt to read past the end of the data.", stream);
+	}
+
+	StreamStats::StreamStats() :
+		bytesIn(0),
+		bytesOut(0),
+		readCalls(0),
+		writeCalls(0),
+		syscalls(0),
+		shortReads(0),
+		shortWrites(0),
+		wouldBlock(0),
+		handlerCalls(0),
+		handlerTime(0)
+	{}
+
+	HubStats::HubStats() :
+		steps(0),
+		polls(0),
+		pollWakeups(0),
+		handlerCalls(0),
+		handlerTime(0),
+		connectionsCreated(0),
+		connectionsClosed(0)
+	{}
+
+	LatencyHistogram::LatencyHistogram()
+	{
+		reset();
+	}
+
+	void LatencyHistogram::record(unsigned long long value)
+	{
+		++counts[bucketIndex(value)];
+		++total;
+		totalValue += value;
+		maxValue = std::max(maxValue, value);
+	}
+
+	void LatencyHistogram::reset()
+	{
+		std::fill(counts, counts + BUCKET_COUNT, 0);
+		total = 0;
+		totalValue = 0;
+		maxValue = 0;
+	}
+
+	unsigned long long LatencyHistogram::percentile(double fraction) const
+	{
+		if (total == 0)
+			return 0;
+
+		// find the first bucket reaching the requested rank
+		const unsigned long long rank(std::max(1.0, std::min(fraction, 1.0) * total + 0.5));
+		unsigned long long seen = 0;
+		for (size_t i = 0; i < BUCKET_COUNT; ++i)
+		{
+			seen += counts[i];
+			if (seen >= rank)
+				return std::min(bucketUpperBound(i), maxValue);
+		}
+		return maxValue;
+	}
+
+	size_t LatencyHistogram::bucketIndex(unsigned long long value)
+	{
+		if (value < SUB_BUCKET_COUNT)
+			return size_t(value);
+
+		// the position of the highest bit selects the power of two, the next bits the sub-bucket
+		unsigned exponent = 0;
+		while ((value >> exponent) >= 2 * SUB_BUCKET_COUNT)
+			++exponent;
+		return (exponent + 1) * SUB_BUCKET_COUNT + size_t(value >> exponent) - SUB_BUCKET_COUNT;
+	}
+
+	unsigned long long LatencyHistogram::bucketUpperBound(size_t index)
+	{
+		if (index < SUB_BUCKET_COUNT)
+			return index;
+
+		const unsigned exponent(index / SUB_BUCKET_COUNT - 1);
+		const unsigned long long lowerBound((unsigned long long)(index % SUB_BUCKET_COUNT + SUB_BUCKET_COUNT) << exponent);
+		return lowerBound + ((1ULL << exponent) - 1);
+	}
+
+	void Hub::setSpinDuration(unsigned microseconds)
+	{
+		spinDuration = microseconds;
+	}
+
+	void Hub::resetLatencies()
+	{
+		latencyHistograms.iteration.reset();
+		latencyHistograms.dispatchDelay.reset();
+		latencyHistograms.handler.reset();
+	}
+
+	//! Append the type line and the value of a metric without labels, in Prometheus text format
+	static void appendMetric(std::string& text, const char* name, const char* type, unsigned long long value)
+	{
+		char line[256];
+		snprintf(line, sizeof(line), "# TYPE %s %s\n%s %llu\n", name, type, name, value);
+		text += line;
+	}
 
-		unsigned char* ptr = (unsigned char*)data;
-		std::copy(receptionBuffer.begin(), receptionBuffer.begin() + size, ptr);
-		receptionBuffer.erase(receptionBuffer.begin(), receptionBuffer.begin() + size);
+	//! Append a summary of a latency histogram, in seconds, in Prometheus text format
+	static void appendSummary(std::string& text, const char* name, const LatencyHistogram& histogram)
+	{
+		const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+		char line[256];
+		snprintf(line, sizeof(line), "# TYPE %s summary\n", name);
+		text += line;
+		for (size_t i = 0; i < sizeof(quantiles) / sizeof(double); ++i)
+		{
+			snprintf(line, sizeof(line), "%s{quantile=\"%g\"} %.9f\n", name, quantiles[i], histogram.percentile(quantiles[i]) * 1e-9);
+			text += line;
+		}
+		snprintf(line, sizeof(line), "%s_sum %.9f\n%s_count %llu\n", name, histogram.sum() * 1e-9, name, histogram.count());
+		text += line;
+	}
+
+	//! Append the label of a stream, holding its escaped target name, in Prometheus text format
+	static void appendStreamLabel(std::string& text, const std::string& targetName)
+	{
+		text += "{stream=\"";
+		for (size_t i = 0; i < targetName.size(); ++i)
+		{
+			if (targetName[i] == '\\' || targetName[i] == '"')
+				text += '\\';
+			text += targetName[i];
+		}
+		text += "\"}";
 	}
 
-	void Hub::closeStream(Stream* stream)
+	void Hub::formatMetrics(std::string& text) const
 	{
-		streams.erase(stream);
-		dataStreams.erase(stream);
-		delete stream;
+		appendMetric(text, "dashel_steps_total", "counter", statistics.steps);
+		appendMetric(text, "dashel_polls_total", "counter", statistics.polls);
+		appendMetric(text, "dashel_poll_wakeups_total", "counter", statistics.pollWakeups);
+		appendMetric(text, "dashel_handler_calls_total", "counter", statistics.handlerCalls);
+		appendMetric(text, "dashel_connections_created_total", "counter", statistics.connectionsCreated);
+		appendMetric(text, "dashel_connections_closed_total", "counter", statistics.connectionsClosed);
+		appendMetric(text, "dashel_streams", "gauge", dataStreams.size());
+		appendSummary(text, "dashel_iteration_seconds", latencyHistograms.iteration);
+		appendSummary(text, "dashel_dispatch_delay_seconds", latencyHistograms.dispatchDelay);
+		appendSummary(text, "dashel_handler_seconds", latencyHistograms.handler);
+
+		if (dataStreams.empty())
+			return;
+
+		// clang-format off
+		const struct
+		{
+			const char* name;
+			unsigned long long StreamStats::*counter;
+		} counters[] = {
+			{ "dashel_stream_bytes_in_total", &StreamStats::bytesIn },
+			{ "dashel_stream_bytes_out_total", &StreamStats::bytesOut },
+			{ "dashel_stream_read_calls_total", &StreamStats::readCalls },
+			{ "dashel_stream_write_calls_total", &StreamStats::writeCalls },
+			{ "dashel_stream_syscalls_total", &StreamStats::syscalls },
+			{ "dashel_stream_short_reads_total", &StreamStats::shortReads },
+			{ "dashel_stream_short_writes_total", &StreamStats::shortWrites },
+			{ "dashel_stream_would_block_total", &StreamStats::wouldBlock },
+			{ "dashel_stream_handler_calls_total", &StreamStats::handlerCalls },
+			{ "dashel_stream_handler_nanoseconds_total", &StreamStats::handlerTime }
+		};
+		// clang-format on
+
+		// the first counter labels each stream with its target name, the others copy that label from text
+		std::vector<std::pair<size_t, size_t> > labels; // position and size of the label of each stream in text
+		labels.reserve(dataStreams.size());
+		char value[64];
+		for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); ++i)
+		{
+			text += "# TYPE ";
+			text += counters[i].name;
+			text += " counter\n";
+			size_t j = 0;
+			for (StreamsSet::const_iterator it = dataStreams.begin(); it != dataStreams.end(); ++it, ++j)
+			{
+				text += counters[i].name;
+				if (i == 0)
+				{
+					const size_t labelPos(text.size());
+					appendStreamLabel(text, (*it)->getTargetName());
+					labels.push_back(std::make_pair(labelPos, text.size() - labelPos));
+				}
+				else
+					text.append(text, labels[j].first, labels[j].second);
+				snprintf(value, sizeof(value), " %llu\n", (*it)->statistics.*counters[i].counter);
+				text += value;
+			}
+		}
+	}
+
+	void Hub::setSlowHandlerThreshold(unsigned long long nanoseconds)
+	{
+		slowHandlerThreshold = nanoseconds;
+	}
+
+	void Hub::recordHandlerTime(Stream* stream, unsigned long long handlerTime)
+	{
+#ifndef DASHEL_NO_STATS
+		++stream->statistics.handlerCalls;
+		stream->statistics.handlerTime += handlerTime;
+		++statistics.handlerCalls;
+		statistics.handlerTime += handlerTime;
+		latencyHistograms.handler.record(handlerTime);
+		if (slowHandlerThreshold && handlerTime >= slowHandlerThreshold)
+			slowHandler(stream, handlerTime);
+#endif
+	}
+
+	void Hub::setCpuAffinity(const std::vector<unsigned>& cpus)
+	{
+		cpuAffinity = cpus;
+		cpuAffinityPending = !cpus.empty();
+	}
+
+	size_t Hub::broadcast(const SharedBuffer& buffer, const StreamsSet& streams)
+	{
+		size_t failures = 0;
+		for (StreamsSet::const_iterator it = streams.begin(); it != streams.end(); ++it)
+		{
+			try
+			{
+				(*it)->writeShared(buffer);
+				(*it)->flush();
+			}
+			catch (const DashelException& e)
+			{
+				assert(e.stream);
+				++failures;
+			}
+		}
+		return failures;
 	}
 
 	void StreamTypeRegistry::reg(const std::string& proto, const CreatorFunc func)
@@ -45,7 +45,6 @@
 #include <cstdlib>
 #include <map>
 #include <vector>
-#include <valarray>
 #include <algorithm>
 #include <iostream>
 #include <sstream>
@@ -62,8 +61,20 @@
 #include <sys/stat.h>
 #include <sys/file.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <pthread.h>
+#include <atomic>
+#include <memory>
+#include <exception>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#ifdef __linux__
+#include <sched.h>
+#endif
 #include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
 
 // clang-format off
 #ifdef __APPLE__
@@ -120,6 +131,7 @@ namespace Dashel
 	{
 		string sysMessage;
 		failedFlag = true;
+		DASHEL_PROBE3(stream__fail, this, int(s), se);
 
 		if (se)
 			sysMessage = strerror(errno);
@@ -127,8 +139,10 @@ namespace Dashel
 		failReason = reason;
 		failReason += " ";
 		failReason += sysMessage;
+		failSource = s;
 
-		throw DashelException(s, se, failReason.c_str(), this);
+		if (throwOnFailure)
+			throw DashelException(s, se, failReason.c_str(), this);
 	}
 
 	// Serial port enumerator
@@ -316,29 +330,200 @@ namespace Dashel
 		return derived;
 	}
 
+	//! Wait for events on file descriptors, using poll emulation where poll is broken
+	static int pollFileDescriptors(struct pollfd* fds, nfds_t count, int timeout)
+	{
+#ifndef USE_POLL_EMU
+		return poll(fds, count, timeout);
+#else
+		return poll_emu(fds, count, timeout);
+#endif
+	}
+
+	//! Return the time of a monotonic clock, in nanoseconds
+	static unsigned long long monotonicNanoseconds()
+	{
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+	}
+
 	// Streams
 
 	SelectableStream::SelectableStream(const string& protocolName) :
 		Stream(protocolName),
 		fd(-1),
 		writeOnly(false),
-		pollEvent(POLLIN)
+		pollEvent(POLLIN),
+		framer(0),
+		internal(false),
+		kind(DataStream),
+		bufferPool(0),
+		readingPaused(false),
+		deliveryPending(false),
+		dispatched(false)
 	{
+		platformStream = this;
 	}
 
 	SelectableStream::~SelectableStream()
 	{
+		delete framer;
+
 		// on POSIX, do not close stdin, stdout, nor stderr
 		if (fd >= 3)
 			close(fd);
 	}
 
+	//! Memory of a Hub for its streams and their buffers, carved out of slabs and recycled through free lists
+	/*!
+		Blocks are grouped in size classes, each with a free list threaded through the free blocks.
+		Slabs are only freed with the pool, so that connection churn does not reach the global heap once the pool is warm.
+		The pool is used with the lock of its Hub held, except by streams served by worker threads,
+		in which case the Hub makes it thread-safe, see setThreadSafe().
+	*/
+	class BufferPool : public SegmentAllocator
+	{
+	protected:
+		// clang-format off
+		//! Pool constants
+		enum Consts
+		{
+			SIZE_CLASS_GRANULARITY = 64, //!< block sizes are multiples of this
+			MAX_POOLED_SIZE = RECV_BUFFER_SIZE, //!< larger blocks are allocated on the heap
+			SIZE_CLASS_COUNT = MAX_POOLED_SIZE / SIZE_CLASS_GRANULARITY, //!< number of size classes
+			SLAB_SIZE = 65536 //!< size of the slabs blocks are carved from
+		};
+		// clang-format on
+
+		//! A free block, linked to the next free block of the same size class
+		struct FreeBlock
+		{
+			FreeBlock* next; //!< next free block, 0 at the end of the list
+		};
+
+		FreeBlock* freeLists[SIZE_CLASS_COUNT]; //!< free blocks of each size class
+		std::vector<void*> slabs; //!< all slabs, freed with the pool
+		bool threadSafe; //!< whether the free lists are protected by mutex
+		pthread_mutex_t mutex; //!< protects free lists and slabs if threadSafe is set
+
+	public:
+		//! Create an empty pool
+		BufferPool() :
+			threadSafe(false)
+		{
+			for (size_t i = 0; i < SIZE_CLASS_COUNT; ++i)
+				freeLists[i] = 0;
+			pthread_mutex_init(&mutex, NULL);
+		}
+
+		//! Free all slabs; all blocks must have been deallocated
+		~BufferPool()
+		{
+			for (size_t i = 0; i < slabs.size(); ++i)
+				::operator delete(slabs[i]);
+			pthread_mutex_destroy(&mutex);
+		}
+
+		//! Set whether the pool can be used from several threads at once, only call while no other thread uses it
+		void setThreadSafe(bool enabled) { threadSafe = enabled; }
+
+		//! Allocate a block of at least size bytes
+		void* allocate(size_t size)
+		{
+			if (size > MAX_POOLED_SIZE)
+				return ::operator new(size);
+			const size_t sizeClass((size + SIZE_CLASS_GRANULARITY - 1) / SIZE_CLASS_GRANULARITY - 1);
+			if (threadSafe)
+				pthread_mutex_lock(&mutex);
+			if (!freeLists[sizeClass])
+				refill(sizeClass);
+			FreeBlock* block(freeLists[sizeClass]);
+			freeLists[sizeClass] = block->next;
+			if (threadSafe)
+				pthread_mutex_unlock(&mutex);
+			return block;
+		}
+
+		//! Give back a block obtained from allocate() with the same size
+		void deallocate(void* ptr, size_t size)
+		{
+			if (size > MAX_POOLED_SIZE)
+			{
+				::operator delete(ptr);
+				return;
+			}
+			const size_t sizeClass((size + SIZE_CLASS_GRANULARITY - 1) / SIZE_CLASS_GRANULARITY - 1);
+			if (threadSafe)
+				pthread_mutex_lock(&mutex);
+			pushFree(sizeClass, ptr);
+			if (threadSafe)
+				pthread_mutex_unlock(&mutex);
+		}
+
+		//! Lend a buffer of RECV_BUFFER_SIZE bytes
+		unsigned char* acquire() { return static_cast<unsigned char*>(allocate(RECV_BUFFER_SIZE)); }
+
+		//! Give back a buffer obtained from acquire()
+		void release(unsigned char* buffer) { deallocate(buffer, RECV_BUFFER_SIZE); }
+
+		virtual void* allocateSegment() { return allocate(SegmentedBuffer::SEGMENT_SIZE); }
+
+		virtual void deallocateSegment(void* segment) { deallocate(segment, SegmentedBuffer::SEGMENT_SIZE); }
+
+	protected:
+		//! Carve a new slab into free blocks of a size class
+		void refill(size_t sizeClass)
+		{
+			const size_t blockSize((sizeClass + 1) * SIZE_CLASS_GRANULARITY);
+			unsigned char* slab(static_cast<unsigned char*>(::operator new(SLAB_SIZE)));
+			slabs.push_back(slab);
+			for (size_t pos = 0; pos + blockSize <= SLAB_SIZE; pos += blockSize)
+				pushFree(sizeClass, slab + pos);
+		}
+
+		//! Add a block to the free list of a size class
+		void pushFree(size_t sizeClass, void* ptr)
+		{
+			FreeBlock* block(static_cast<FreeBlock*>(ptr));
+			block->next = freeLists[sizeClass];
+			freeLists[sizeClass] = block;
+		}
+	};
+
+	//! Header placed before every stream object, to know where to give its memory back
+	struct StreamAllocationHeader
+	{
+		BufferPool* pool; //!< pool the stream was allocated from, 0 for the heap
+		size_t size; //!< size of the allocation, including this header
+	};
+
+	void* SelectableStream::operator new(size_t size, BufferPool* pool)
+	{
+		const size_t totalSize(size + sizeof(StreamAllocationHeader));
+		StreamAllocationHeader* header(static_cast<StreamAllocationHeader*>(pool ? pool->allocate(totalSize) : ::operator new(totalSize)));
+		header->pool = pool;
+		header->size = totalSize;
+		return header + 1;
+	}
+
+	void SelectableStream::operator delete(void* ptr)
+	{
+		if (!ptr)
+			return;
+		StreamAllocationHeader* header(static_cast<StreamAllocationHeader*>(ptr) - 1);
+		if (header->pool)
+			header->pool->deallocate(header, header->size);
+		else
+			::operator delete(header);
+	}
+
 	//! In addition its parent, this stream can also make select return because of the target has disconnected
 	class DisconnectableStream : public SelectableStream
 	{
 	protected:
 		friend class Hub;
-		unsigned char recvBuffer[RECV_BUFFER_SIZE]; //!< reception buffer
+		unsigned char* recvBuffer; //!< reception buffer of RECV_BUFFER_SIZE bytes, borrowed from bufferPool when data are received, if any
 		size_t recvBufferPos; //!< position of read in reception buffer
 		size_t recvBufferSize; //!< amount of data in reception buffer
 
@@ -347,15 +532,83 @@ namespace Dashel
 		explicit DisconnectableStream(const string& protocolName) :
 			Stream(protocolName),
 			SelectableStream(protocolName),
+			recvBuffer(0),
 			recvBufferPos(0),
 			recvBufferSize(0)
 		{
 		}
 
+		virtual ~DisconnectableStream()
+		{
+			recvBufferPos = recvBufferSize;
+			releaseRecvBuffer();
+			delete[] recvBuffer;
+		}
+
+		virtual void releaseRecvBuffer()
+		{
+			// without a pool, the stream keeps its buffer
+			if (recvBuffer && bufferPool && recvBufferPos == recvBufferSize)
+			{
+				bufferPool->release(recvBuffer);
+				recvBuffer = 0;
+			}
+		}
+
+		//! Make sure recvBuffer is allocated, before receiving data into it
+		void acquireRecvBuffer()
+		{
+			if (!recvBuffer)
+				recvBuffer = bufferPool ? bufferPool->acquire() : new unsigned char[RECV_BUFFER_SIZE];
+		}
+
 		//! Return true while there is some unread data in the reception buffer
 		virtual bool isDataInRecvBuffer() const { return recvBufferPos != recvBufferSize; }
+
+		virtual const unsigned char* takeRecvBuffer(size_t& size)
+		{
+			const unsigned char* data = recvBuffer + recvBufferPos;
+			size = recvBufferSize - recvBufferPos;
+			recvBufferPos = recvBufferSize;
+			return data;
+		}
+
+		virtual bool supportsFraming() const { return true; }
+	};
+
+	//! Parameters of listening streams that are passed to the streams of their incoming connections
+	static const char* const inheritedParameters[] = {
+		"framing",
+		"framingHeader",
+		"framingOffset",
+		"framingInclusive",
+		"framingMax",
+		"framingDelim",
+		"busyPoll",
+		"preferBusyPoll"
 	};
 
+	//! Set the busy-polling options of a socket from its target, if any.
+	static void setupBusyPoll(int fd, const ParameterSet& target)
+	{
+#ifdef SO_BUSY_POLL
+		if (target.isSet("busyPoll"))
+		{
+			int duration = target.get<int>("busyPoll");
+			if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &duration, sizeof(duration)) < 0)
+				throw DashelException(DashelException::ConnectionFailed, errno, "Cannot set busy-polling duration, large values require CAP_NET_ADMIN.");
+		}
+#endif
+#ifdef SO_PREFER_BUSY_POLL
+		if (target.isSet("preferBusyPoll"))
+		{
+			int flag = target.get<bool>("preferBusyPoll") ? 1 : 0;
+			if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &flag, sizeof(flag)) < 0)
+				throw DashelException(DashelException::ConnectionFailed, errno, "Cannot set busy-polling preference.");
+		}
+#endif
+	}
+
 	//! Assign a socket file descriptor to a target. Factored out from SocketStream::SocketStream.
 	//! If the target specifies a socket with a nonnegative "sock=N" parameter, assume it is valid
 	//! and use it. Otherwise, the host and port parameters are used to look up a TCP/IP host, and
@@ -392,28 +645,33 @@ namespace Dashel
 	class SocketStream : public DisconnectableStream
 	{
 	protected:
-#ifndef TCP_CORK
 		// clang-format off
 		//! Socket constants
 		enum Consts
 		{
-			SEND_BUFFER_SIZE_INITIAL = 256, //!< initial size of the socket send sendBuffer
-			SEND_BUFFER_SIZE_LIMIT = 65536 //!< when the socket send sendBuffer reaches this size, a flush is forced
+			SEND_BUFFER_SIZE_LIMIT = 65536 //!< when the socket send sendBuffer reaches this size, it is sent without waiting for a flush
 		};
 		// clang-format on
 
-		ExpandableBuffer sendBuffer;
-#endif
+		//! Data written but not sent yet, its segments are given back when sent so that idle streams hold none
+		SegmentedBuffer sendBuffer;
+		//! Shared buffers written after the data in sendBuffer, sent on flush
+		std::vector<SharedBuffer> sendQueue;
+
+		// for accepted connections, target is built from these on first use, see describeTarget()
+		std::shared_ptr<const ParameterSet> listenerTarget; //!< parameters of the listening stream that apply to this connection
+		IPV4Address remoteAddress; //!< address of the remote end of the connection
+		unsigned short connectionPort; //!< port of the listening stream that accepted the connection
+		bool resolveName; //!< whether to resolve the host name of the remote address
+		mutable std::string hostName; //!< resolved host name of the remote address, empty until the target is first described
 
 	public:
 		//! Create a socket stream to the following destination
 		explicit SocketStream(const string& targetName) :
 			Stream("tcp"),
-			DisconnectableStream("tcp")
-#ifndef TCP_CORK
-			,
-			sendBuffer(SEND_BUFFER_SIZE_INITIAL)
-#endif
+			DisconnectableStream("tcp"),
+			connectionPort(0),
+			resolveName(false)
 		{
 			target.add("tcp:host;port;connectionPort=-1;sock=-1");
 			target.add(targetName.c_str());
@@ -425,6 +683,30 @@ namespace Dashel
 				target.erase("sock");
 			}
 
+			setupBusyPoll(fd, target);
+
+#ifdef TCP_CORK
+			// setup TCP Cork for delayed sending
+			int flag = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_CORK, &flag, sizeof(flag));
+#endif
+		}
+
+		//! Create a socket stream for a connection accepted by a listening stream, deferring its target until it is looked at
+		SocketStream(int socket, const IPV4Address& remoteAddress, unsigned short connectionPort, bool resolveName, const std::shared_ptr<const ParameterSet>& listenerTarget) :
+			Stream("tcp"),
+			DisconnectableStream("tcp"),
+			listenerTarget(listenerTarget),
+			remoteAddress(remoteAddress),
+			connectionPort(connectionPort),
+			resolveName(resolveName)
+		{
+			fd = socket;
+			targetDeferred = true;
+
+			setupBusyPoll(fd, *listenerTarget);
+			framer = MessageFramer::create(*listenerTarget);
+
 #ifdef TCP_CORK
 			// setup TCP Cork for delayed sending
 			int flag = 1;
@@ -441,6 +723,30 @@ namespace Dashel
 				shutdown(fd, SHUT_RDWR);
 		}
 
+		virtual void setBufferPool(BufferPool* pool)
+		{
+			DisconnectableStream::setBufferPool(pool);
+			sendBuffer.setAllocator(pool);
+		}
+
+		virtual void describeTarget(ParameterSet& parameters) const
+		{
+			char buffer[INET_ADDRSTRLEN];
+			const struct in_addr addr = { htonl(remoteAddress.address) };
+			// resolution blocks, so it is only done once even though the target is not kept
+			if (resolveName && hostName.empty())
+				hostName = remoteAddress.hostname();
+			parameters.addParam("host", resolveName ? hostName.c_str() : inet_ntop(AF_INET, &addr, buffer, sizeof(buffer)));
+			snprintf(buffer, sizeof(buffer), "%u", remoteAddress.port);
+			parameters.addParam("port", buffer);
+			snprintf(buffer, sizeof(buffer), "%u", connectionPort);
+			parameters.addParam("connectionPort", buffer);
+			// pass the parameters of the listening stream that apply to its connections
+			for (size_t i = 0; i < sizeof(inheritedParameters) / sizeof(const char*); ++i)
+				if (listenerTarget->isSet(inheritedParameters[i]))
+					parameters.setValue(inheritedParameters[i], listenerTarget->get(inheritedParameters[i]));
+		}
+
 		virtual void write(const void* data, const size_t size)
 		{
 			assert(fd >= 0);
@@ -448,21 +754,25 @@ namespace Dashel
 			if (size == 0)
 				return;
 
-#ifdef TCP_CORK
-			send(data, size);
-#else
+			DASHEL_STAT(++statistics.writeCalls; statistics.bytesOut += size);
+
+			if (!sendQueue.empty())
+				sendQueued();
+
+			// small writes are gathered in one system call, large ones are sent directly after the data buffered before them
 			if (size >= SEND_BUFFER_SIZE_LIMIT)
 			{
-				flush();
-				send(data, size);
+				if (!sendBuffer.empty())
+					sendQueued();
+				if (!failed())
+					send(data, size);
 			}
 			else
 			{
 				sendBuffer.add(data, size);
 				if (sendBuffer.size() >= SEND_BUFFER_SIZE_LIMIT)
-					flush();
+					sendQueued();
 			}
-#endif
 		}
 
 		//! Send all data over the socket
@@ -480,35 +790,128 @@ namespace Dashel
 #else
 				ssize_t len = ::send(fd, ptr, left, MSG_NOSIGNAL);
 #endif
+				DASHEL_PROBE3(socket__send, this, fd, len);
+				DASHEL_STAT(++statistics.syscalls);
 
 				if (len < 0)
 				{
+					DASHEL_STAT(if (errno == EAGAIN || errno == EWOULDBLOCK) ++statistics.wouldBlock);
 					fail(DashelException::IOError, errno, "Socket write I/O error.");
+					return;
 				}
 				else if (len == 0)
 				{
 					fail(DashelException::ConnectionLost, 0, "Connection lost.");
+					return;
 				}
 				else
 				{
+					DASHEL_STAT(if (size_t(len) < left) ++statistics.shortWrites);
 					ptr += len;
 					left -= len;
 				}
 			}
 		}
 
+		virtual void writeShared(const SharedBuffer& buffer)
+		{
+			assert(fd >= 0);
+
+			DASHEL_STAT(++statistics.writeCalls; statistics.bytesOut += buffer.size());
+
+			if (buffer.size() != 0)
+				sendQueue.push_back(buffer);
+		}
+
+		//! Send the buffered data followed by the queued shared buffers, gathering them in as few system calls as possible
+		void sendQueued()
+		{
+			const size_t batchSize = 32;
+			const SegmentedBuffer::Segment* segment = sendBuffer.front();
+			size_t queuePos = 0;
+			do
+			{
+				struct iovec iov[batchSize];
+				size_t count = 0;
+				for (; segment && count < batchSize; segment = segment->next, ++count)
+				{
+					iov[count].iov_base = (void*)segment->data();
+					iov[count].iov_len = segment->size;
+				}
+				for (; queuePos < sendQueue.size() && count < batchSize; ++queuePos, ++count)
+				{
+					iov[count].iov_base = (void*)sendQueue[queuePos].data();
+					iov[count].iov_len = sendQueue[queuePos].size();
+				}
+				send(iov, count);
+			} while (!failed() && (segment || queuePos < sendQueue.size()));
+			sendBuffer.clear();
+			sendQueue.clear();
+		}
+
+		//! Send all data of an array of buffers over the socket
+		void send(struct iovec* iov, size_t count)
+		{
+			assert(fd >= 0);
+
+			while (count)
+			{
+				struct msghdr msg;
+				memset(&msg, 0, sizeof(msg));
+				msg.msg_iov = iov;
+				msg.msg_iovlen = count;
+#ifdef MACOSX
+				ssize_t len = ::sendmsg(fd, &msg, 0);
+#else
+				ssize_t len = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+#endif
+				DASHEL_PROBE3(socket__send, this, fd, len);
+				DASHEL_STAT(++statistics.syscalls);
+
+				if (len < 0)
+				{
+					DASHEL_STAT(if (errno == EAGAIN || errno == EWOULDBLOCK) ++statistics.wouldBlock);
+					fail(DashelException::IOError, errno, "Socket write I/O error.");
+					return;
+				}
+				else if (len == 0)
+				{
+					fail(DashelException::ConnectionLost, 0, "Connection lost.");
+					return;
+				}
+				else
+				{
+					// skip the buffers sent, and the sent part of the last one
+					size_t sent = len;
+					while (count && sent >= iov->iov_len)
+					{
+						sent -= iov->iov_len;
+						++iov;
+						--count;
+					}
+					if (count)
+					{
+						DASHEL_STAT(++statistics.shortWrites);
+						iov->iov_base = (unsigned char*)iov->iov_base + sent;
+						iov->iov_len -= sent;
+					}
+				}
+			}
+		}
+
 		virtual void flush()
 		{
 			assert(fd >= 0);
 
+			if (!sendQueue.empty() || !sendBuffer.empty())
+				sendQueued();
+
 #ifdef TCP_CORK
+			// uncork to send the last partial segment
 			int flag = 0;
 			setsockopt(fd, IPPROTO_TCP, TCP_CORK, &flag, sizeof(flag));
 			flag = 1;
 			setsockopt(fd, IPPROTO_TCP, TCP_CORK, &flag, sizeof(flag));
-#else
-			send(sendBuffer.get(), sendBuffer.size());
-			sendBuffer.clear();
 #endif
 		}
 
@@ -519,6 +922,8 @@ namespace Dashel
 			if (size == 0)
 				return;
 
+			DASHEL_STAT(++statistics.readCalls; statistics.bytesIn += size);
+
 			unsigned char* ptr = (unsigned char*)data;
 			size_t left = size;
 
@@ -534,28 +939,84 @@ namespace Dashel
 			while (left)
 			{
 				ssize_t len = recv(fd, ptr, left, 0);
+				DASHEL_PROBE3(socket__recv, this, fd, len);
+				DASHEL_STAT(++statistics.syscalls);
 
 				if (len < 0)
 				{
 					fail(DashelException::IOError, errno, "Socket read I/O error.");
+					return;
 				}
 				else if (len == 0)
 				{
 					fail(DashelException::ConnectionLost, 0, "Connection lost.");
+					return;
 				}
 				else
 				{
+					DASHEL_STAT(if (size_t(len) < left) ++statistics.shortReads);
 					ptr += len;
 					left -= len;
 				}
 			}
 		}
 
+		virtual size_t readSome(void* data, size_t size)
+		{
+			assert(fd >= 0);
+
+			if (size == 0)
+				return 0;
+
+			unsigned char* ptr = (unsigned char*)data;
+			size_t left = size;
+
+			if (isDataInRecvBuffer())
+			{
+				size_t toCopy = std::min(recvBufferSize - recvBufferPos, size);
+				memcpy(ptr, recvBuffer + recvBufferPos, toCopy);
+				recvBufferPos += toCopy;
+				ptr += toCopy;
+				left -= toCopy;
+			}
+
+			if (left)
+			{
+				ssize_t len = recv(fd, ptr, left, MSG_DONTWAIT);
+				DASHEL_PROBE3(socket__recv, this, fd, len);
+				DASHEL_STAT(++statistics.syscalls);
+
+				if (len < 0)
+				{
+					if (errno == EAGAIN || errno == EWOULDBLOCK)
+						DASHEL_STAT(++statistics.wouldBlock);
+					else
+						fail(DashelException::IOError, errno, "Socket read I/O error.");
+				}
+				else if (len == 0)
+				{
+					if (left == size)
+						fail(DashelException::ConnectionLost, 0, "Connection lost.");
+				}
+				else
+				{
+					DASHEL_STAT(if (size_t(len) < left) ++statistics.shortReads);
+					left -= len;
+				}
+			}
+
+			DASHEL_STAT(++statistics.readCalls; statistics.bytesIn += size - left);
+			return size - left;
+		}
+
 		virtual bool receiveDataAndCheckDisconnection()
 		{
 			assert(recvBufferPos == recvBufferSize);
 
-			ssize_t len = recv(fd, &recvBuffer, RECV_BUFFER_SIZE, 0);
+			acquireRecvBuffer();
+			ssize_t len = recv(fd, recvBuffer, RECV_BUFFER_SIZE, 0);
+			DASHEL_PROBE3(socket__recv, this, fd, len);
+			DASHEL_STAT(++statistics.syscalls);
 			if (len > 0)
 			{
 				recvBufferSize = len;
@@ -613,13 +1074,17 @@ namespace Dashel
 	*/
 	class SocketServerStream : public SelectableStream
 	{
+	protected:
+		std::shared_ptr<const ParameterSet> connectionTarget; //!< parameters passed to accepted connections, shared by all of them
+
 	public:
 		//! Create the stream and associates a file descriptor
-		explicit SocketServerStream(const std::string& targetName) :
-			Stream("tcpin"),
-			SelectableStream("tcpin")
+		explicit SocketServerStream(const std::string& targetName, const std::string& protocolName = "tcpin") :
+			Stream(protocolName),
+			SelectableStream(protocolName)
 		{
-			target.add("tcpin:port=5000;address=0.0.0.0");
+			kind = SocketListener;
+			target.add((protocolName + ":port=5000;address=0.0.0.0").c_str());
 			target.add(targetName.c_str());
 
 			IPV4Address bindAddress(target.get("address"), target.get<int>("port"));
@@ -657,8 +1122,23 @@ namespace Dashel
 			// Listen on socket, backlog is sort of arbitrary.
 			if (listen(fd, 16) < 0)
 				throw DashelException(DashelException::ConnectionFailed, errno, "Cannot listen on socket.");
+
+			ParameterSet* parameters(new ParameterSet);
+			connectionTarget.reset(parameters);
+			for (size_t i = 0; i < sizeof(inheritedParameters) / sizeof(const char*); ++i)
+				if (target.isSet(inheritedParameters[i]))
+					parameters->setValue(inheritedParameters[i], target.get(inheritedParameters[i]));
+		}
+
+		//! Create a tcp stream for an accepted connection, allocated from the pool of the Hub
+		SelectableStream* createConnection(int fd, const IPV4Address& remoteAddress, bool resolveName)
+		{
+			return new (bufferPool) SocketStream(fd, remoteAddress, atoi(target.get("port").c_str()), resolveName, connectionTarget);
 		}
 
+		//! Return an internal stream serving an accepted connection, or 0 to let the Hub create a tcp stream for it
+		virtual SelectableStream* createInternalConnection(int fd) { return 0; }
+
 		// clang-format off
 		virtual void write(const void* data, const size_t size) { /* hook for use by derived classes */ }
 		virtual void flush() { /* hook for use by derived classes */ }
@@ -668,47 +1148,244 @@ namespace Dashel
 		// clang-format on
 	};
 
-	//! UDP Socket, uses sendto/recvfrom for read/write
-	class UDPSocketStream : public MemoryPacketStream, public SelectableStream
+	//! Connection to a metrics listener, answering HTTP requests with the metrics of the Hub
+	class MetricsConnectionStream : public SelectableStream
 	{
-	private:
-		mutable bool selectWasCalled;
+	protected:
+		// clang-format off
+		//! Metrics constants
+		enum Consts
+		{
+			REQUEST_SIZE_LIMIT = 8192 //!< size of the largest request header accepted
+		};
+		// clang-format on
+
+		const Hub& hub; //!< hub whose metrics are served
+		std::string request; //!< received part of the current request
+		char header[256]; //!< header of the response being sent
+		size_t headerSize; //!< size of header
+		std::string response; //!< body of the response being sent, kept between requests to reuse its memory
+		size_t sentSize; //!< amount of the header and body already sent
+		bool keepAlive; //!< whether to wait for another request once the response is sent
 
 	public:
-		//! Create as UDP socket stream on a specific port
-		explicit UDPSocketStream(const string& targetName) :
-			Stream("udp"),
-			MemoryPacketStream("udp"),
-			SelectableStream("udp"),
-			selectWasCalled(false)
+		//! Create the stream for an accepted connection, which is made non-blocking so that slow clients do not stall the Hub
+		MetricsConnectionStream(int fd, const Hub& hub) :
+			Stream("metrics"),
+			SelectableStream("metrics"),
+			hub(hub),
+			headerSize(0),
+			sentSize(0),
+			keepAlive(false)
 		{
-			target.add("udp:port=5000;address=0.0.0.0;sock=-1");
-			target.add(targetName.c_str());
+			this->fd = fd;
+			internal = true;
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		}
 
-			fd = target.get<int>("sock");
-			if (fd < 0)
+		virtual bool serveInternally()
+		{
+			// continue sending the response the client was not ready to receive
+			if (pollEvent == POLLOUT)
 			{
-				// create socket
-				fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-				if (fd < 0)
-					throw DashelException(DashelException::ConnectionFailed, errno, "Cannot create socket.");
+				if (!sendResponse())
+					return true;
+				if (sentSize < headerSize + response.size())
+					return false;
+				if (!keepAlive)
+					return true;
+				pollEvent = POLLIN;
+				return answerRequests();
+			}
 
-				IPV4Address bindAddress(target.get("address"), target.get<int>("port"));
+			char buffer[4096];
+			const ssize_t len = recv(fd, buffer, sizeof(buffer), 0);
+			if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return false;
+			if (len <= 0)
+				return true;
+			request.append(buffer, len);
+			return answerRequests();
+		}
 
-				// bind
-				sockaddr_in addr;
-				addr.sin_family = AF_INET;
-				addr.sin_port = htons(bindAddress.port);
-				addr.sin_addr.s_addr = htonl(bindAddress.address);
-				if (::bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
-					throw DashelException(DashelException::ConnectionFailed, errno, "Cannot bind socket to port, probably the port is already in use.");
+		// clang-format off
+		virtual void write(const void* data, const size_t size) { /* hook for use by derived classes */ }
+		virtual void flush() { /* hook for use by derived classes */ }
+		virtual void read(void* data, size_t size) { /* hook for use by derived classes */ }
+		virtual bool receiveDataAndCheckDisconnection() { return false; }
+		virtual bool isDataInRecvBuffer() const { return false; }
+		// clang-format on
 
-				// retrieve port number, if a dynamic one was requested
-				if (bindAddress.port == 0)
+	protected:
+		//! Answer the complete requests received, until a response cannot be sent at once; return true if the connection must be closed
+		bool answerRequests()
+		{
+			size_t headerEnd;
+			while ((headerEnd = request.find("\r\n\r\n")) != std::string::npos)
+			{
+				const std::string requestLine(request, 0, request.find("\r\n"));
+				keepAlive = requestLine.find("HTTP/1.1") != std::string::npos && request.find("Connection: close") >= headerEnd;
+				request.erase(0, headerEnd + 4);
+
+				prepareResponse(requestLine);
+				if (!sendResponse())
+					return true;
+				if (sentSize < headerSize + response.size())
 				{
-					socklen_t sizeof_addr(sizeof(addr));
-					if (::getsockname(fd, (struct sockaddr*)&addr, &sizeof_addr) != 0)
-						throw DashelException(DashelException::ConnectionFailed, errno, "Cannot retrieve socket port assignment.");
+					// wait for the client to receive the rest, further requests are answered afterwards
+					pollEvent = POLLOUT;
+					return false;
+				}
+				if (!keepAlive)
+					return true;
+			}
+			return request.size() > REQUEST_SIZE_LIMIT;
+		}
+
+		//! Fill header and response with the answer to a request
+		void prepareResponse(const std::string& requestLine)
+		{
+			const char* status;
+			response.clear();
+			if (requestLine.compare(0, 4, "GET ") != 0)
+				status = "405 Method Not Allowed";
+			else if (requestLine.compare(4, 2, "/ ") == 0 || requestLine.compare(4, 9, "/metrics ") == 0 || requestLine.compare(4, 9, "/metrics?") == 0)
+			{
+				status = "200 OK";
+				hub.formatMetrics(response);
+			}
+			else
+				status = "404 Not Found";
+
+			headerSize = snprintf(header, sizeof(header),
+				"HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %lu\r\nConnection: %s\r\n\r\n",
+				status, (unsigned long)response.size(), keepAlive ? "keep-alive" : "close");
+			sentSize = 0;
+		}
+
+		//! Send as much of the response as the socket accepts without blocking, return false if the connection failed
+		bool sendResponse()
+		{
+			while (sentSize < headerSize + response.size())
+			{
+				struct iovec iov[2];
+				size_t count = 0;
+				if (sentSize < headerSize)
+				{
+					iov[count].iov_base = header + sentSize;
+					iov[count].iov_len = headerSize - sentSize;
+					++count;
+				}
+				const size_t bodySent(sentSize > headerSize ? sentSize - headerSize : 0);
+				if (bodySent < response.size())
+				{
+					iov[count].iov_base = (void*)(response.data() + bodySent);
+					iov[count].iov_len = response.size() - bodySent;
+					++count;
+				}
+
+				struct msghdr msg;
+				memset(&msg, 0, sizeof(msg));
+				msg.msg_iov = iov;
+				msg.msg_iovlen = count;
+#ifdef MACOSX
+				const ssize_t len = ::sendmsg(fd, &msg, 0);
+#else
+				const ssize_t len = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+#endif
+				if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+					return true;
+				if (len <= 0)
+					return false;
+				sentSize += len;
+			}
+			return true;
+		}
+	};
+
+	//! Listen for connections whose HTTP requests are answered with the metrics of the Hub
+	class MetricsServerStream : public SocketServerStream
+	{
+	protected:
+		const Hub& hub; //!< hub whose metrics are served
+
+	public:
+		//! Create the stream and associates a file descriptor
+		MetricsServerStream(const std::string& targetName, const Hub& hub) :
+			Stream("metricsin"),
+			SocketServerStream(targetName, "metricsin"),
+			hub(hub)
+		{}
+
+		virtual SelectableStream* createInternalConnection(int fd)
+		{
+			return new (bufferPool) MetricsConnectionStream(fd, hub);
+		}
+	};
+
+	//! UDP Socket, uses sendto/recvfrom for read/write
+	class UDPSocketStream : public MemoryPacketStream, public SelectableStream
+	{
+	private:
+		mutable bool selectWasCalled;
+		mutable bool receiveWasCalled; //!< whether receive() was called since the last call to isDataInRecvBuffer()
+		bool groEnabled; //!< whether the system may coalesce received datagrams
+		bool gsoUnsupported; //!< whether the system refused segmentation offload, in which case segments are sent one by one
+		std::vector<unsigned char> coalescedBuffer; //!< datagrams received at once, when coalesced by the system
+		size_t coalescedPos; //!< position of the next datagram in coalescedBuffer
+		size_t coalescedSize; //!< amount of data in coalescedBuffer
+		size_t coalescedSegmentSize; //!< size of each coalesced datagram, except possibly the last one
+		IPV4Address coalescedSource; //!< source of the coalesced datagrams
+
+	public:
+		//! Create as UDP socket stream on a specific port
+		explicit UDPSocketStream(const string& targetName) :
+			Stream("udp"),
+			MemoryPacketStream("udp"),
+			SelectableStream("udp"),
+			selectWasCalled(false),
+			receiveWasCalled(false),
+			groEnabled(false),
+			gsoUnsupported(false),
+			coalescedPos(0),
+			coalescedSize(0),
+			coalescedSegmentSize(0)
+		{
+			target.add("udp:port=5000;address=0.0.0.0;sock=-1");
+			target.add(targetName.c_str());
+
+			fd = target.get<int>("sock");
+			if (fd < 0)
+			{
+				// create socket
+				fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+				if (fd < 0)
+					throw DashelException(DashelException::ConnectionFailed, errno, "Cannot create socket.");
+
+				IPV4Address bindAddress(target.get("address"), target.get<int>("port"));
+
+				// let several members of a multicast group on this host share the port
+				if (target.isSet("group"))
+				{
+					int flag = 1;
+					if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) < 0)
+						throw DashelException(DashelException::ConnectionFailed, errno, "Cannot set address reuse flag on socket.");
+				}
+
+				// bind
+				sockaddr_in addr;
+				addr.sin_family = AF_INET;
+				addr.sin_port = htons(bindAddress.port);
+				addr.sin_addr.s_addr = htonl(bindAddress.address);
+				if (::bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+					throw DashelException(DashelException::ConnectionFailed, errno, "Cannot bind socket to port, probably the port is already in use.");
+
+				// retrieve port number, if a dynamic one was requested
+				if (bindAddress.port == 0)
+				{
+					socklen_t sizeof_addr(sizeof(addr));
+					if (::getsockname(fd, (struct sockaddr*)&addr, &sizeof_addr) != 0)
+						throw DashelException(DashelException::ConnectionFailed, errno, "Cannot retrieve socket port assignment.");
 					target.erase("port");
 					ostringstream portnum;
 					portnum << ntohs(addr.sin_port);
@@ -724,6 +1401,58 @@ namespace Dashel
 			// enable broadcast
 			int broadcastPermission = 1;
 			setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &broadcastPermission, sizeof(broadcastPermission));
+
+			setupMulticast();
+			setupBusyPoll(fd, target);
+
+#ifdef UDP_GRO
+			// let the system coalesce received datagrams, if it supports it
+			if (target.isSet("gro") && target.get<bool>("gro"))
+			{
+				int flag = 1;
+				groEnabled = (setsockopt(fd, SOL_UDP, UDP_GRO, &flag, sizeof(flag)) == 0);
+			}
+#endif
+		}
+
+		//! Join the multicast group and set the multicast options given in target, if any
+		void setupMulticast()
+		{
+			struct in_addr interfaceAddr;
+			interfaceAddr.s_addr = htonl(INADDR_ANY);
+			if (target.isSet("iface"))
+			{
+				interfaceAddr.s_addr = htonl(IPV4Address(target.get("iface"), 0).address);
+				if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &interfaceAddr, sizeof(interfaceAddr)) < 0)
+					throw DashelException(DashelException::ConnectionFailed, errno, "Cannot set multicast interface.");
+			}
+
+			if (target.isSet("group"))
+			{
+				const IPV4Address groupAddress(target.get("group"), 0);
+				if (!IN_MULTICAST(groupAddress.address))
+					throw DashelException(DashelException::InvalidTarget, 0, "Group is not a multicast address.");
+
+				struct ip_mreq membership;
+				membership.imr_multiaddr.s_addr = htonl(groupAddress.address);
+				membership.imr_interface = interfaceAddr;
+				if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0)
+					throw DashelException(DashelException::ConnectionFailed, errno, "Cannot join multicast group.");
+			}
+
+			if (target.isSet("ttl"))
+			{
+				unsigned char ttl = target.get<unsigned>("ttl");
+				if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0)
+					throw DashelException(DashelException::ConnectionFailed, errno, "Cannot set multicast time-to-live.");
+			}
+
+			if (target.isSet("loop"))
+			{
+				unsigned char loop = target.get<bool>("loop") ? 1 : 0;
+				if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0)
+					throw DashelException(DashelException::ConnectionFailed, errno, "Cannot set multicast loopback.");
+			}
 		}
 
 		virtual void send(const IPV4Address& dest)
@@ -734,23 +1463,152 @@ namespace Dashel
 			addr.sin_addr.s_addr = htonl(dest.address);
 
 			ssize_t sent = sendto(fd, sendBuffer.get(), sendBuffer.size(), 0, (struct sockaddr*)&addr, sizeof(addr));
+			DASHEL_PROBE3(udp__send, this, fd, sent);
+			DASHEL_STAT(++statistics.syscalls);
 			if (sent < 0 || static_cast<size_t>(sent) != sendBuffer.size())
 				fail(DashelException::IOError, errno, "UDP Socket write I/O error.");
 
-			sendBuffer.clear();
+			clearSendBuffer();
+		}
+
+		virtual void sendSegmented(const IPV4Address& dest, size_t segmentSize)
+		{
+#ifdef UDP_SEGMENT
+			// the system accepts at most 64 segments and 64 kB per call
+			const size_t maxSegments = segmentSize ? std::min<size_t>(64, 65507 / segmentSize) : 0;
+			if (gsoUnsupported || maxSegments < 2 || sendBuffer.size() <= segmentSize)
+			{
+				MemoryPacketStream::sendSegmented(dest, segmentSize);
+				return;
+			}
+
+			sockaddr_in addr;
+			addr.sin_family = AF_INET;
+			addr.sin_port = htons(dest.port);
+			addr.sin_addr.s_addr = htonl(dest.address);
+
+			const unsigned char* ptr = sendBuffer.get();
+			size_t left = sendBuffer.size();
+			while (left)
+			{
+				const size_t size = std::min(left, maxSegments * segmentSize);
+
+				struct iovec iov;
+				iov.iov_base = (void*)ptr;
+				iov.iov_len = size;
+
+				char control[CMSG_SPACE(sizeof(uint16_t))];
+				memset(control, 0, sizeof(control));
+				struct msghdr msg;
+				memset(&msg, 0, sizeof(msg));
+				msg.msg_name = &addr;
+				msg.msg_namelen = sizeof(addr);
+				msg.msg_iov = &iov;
+				msg.msg_iovlen = 1;
+				if (size > segmentSize)
+				{
+					msg.msg_control = control;
+					msg.msg_controllen = sizeof(control);
+					struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+					cmsg->cmsg_level = SOL_UDP;
+					cmsg->cmsg_type = UDP_SEGMENT;
+					cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+					*(uint16_t*)CMSG_DATA(cmsg) = segmentSize;
+				}
+
+				ssize_t sent = sendmsg(fd, &msg, 0);
+				DASHEL_PROBE3(udp__send, this, fd, sent);
+				DASHEL_STAT(++statistics.syscalls);
+				if (sent < 0 && ptr == sendBuffer.get() && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP))
+				{
+					// segmentation offload is not available, fall back to sending segments one by one
+					gsoUnsupported = true;
+					MemoryPacketStream::sendSegmented(dest, segmentSize);
+					return;
+				}
+				if (sent < 0 || static_cast<size_t>(sent) != size)
+				{
+					fail(DashelException::IOError, errno, "UDP Socket write I/O error.");
+					break;
+				}
+
+				ptr += size;
+				left -= size;
+			}
+
+			clearSendBuffer();
+#else
+			MemoryPacketStream::sendSegmented(dest, segmentSize);
+#endif
 		}
 
 		virtual void receive(IPV4Address& source)
 		{
+			receiveWasCalled = true;
+
+			// return the datagrams coalesced by the system one by one
+			if (coalescedPos < coalescedSize)
+			{
+				const size_t size = std::min(coalescedSegmentSize, coalescedSize - coalescedPos);
+				setReceived(&coalescedBuffer[coalescedPos], size);
+				coalescedPos += size;
+				source = coalescedSource;
+				return;
+			}
+
+#ifdef UDP_GRO
+			if (groEnabled)
+			{
+				coalescedBuffer.resize(65536);
+
+				sockaddr_in addr;
+				struct iovec iov;
+				iov.iov_base = &coalescedBuffer[0];
+				iov.iov_len = coalescedBuffer.size();
+				char control[CMSG_SPACE(sizeof(int))];
+				struct msghdr msg;
+				memset(&msg, 0, sizeof(msg));
+				msg.msg_name = &addr;
+				msg.msg_namelen = sizeof(addr);
+				msg.msg_iov = &iov;
+				msg.msg_iovlen = 1;
+				msg.msg_control = control;
+				msg.msg_controllen = sizeof(control);
+				ssize_t recvCount = recvmsg(fd, &msg, 0);
+				DASHEL_PROBE3(udp__receive, this, fd, recvCount);
+				DASHEL_STAT(++statistics.syscalls);
+				if (recvCount <= 0)
+				{
+					fail(DashelException::ConnectionLost, errno, "UDP Socket read I/O error.");
+					return;
+				}
+
+				coalescedSegmentSize = recvCount;
+				for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+					if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+						coalescedSegmentSize = *(int*)CMSG_DATA(cmsg);
+				coalescedPos = 0;
+				coalescedSize = recvCount;
+				coalescedSource = IPV4Address(ntohl(addr.sin_addr.s_addr), ntohs(addr.sin_port));
+
+				receive(source);
+				return;
+			}
+#endif
+
 			unsigned char buf[4096];
 			sockaddr_in addr;
 			socklen_t addrLen = sizeof(addr);
 			ssize_t recvCount = recvfrom(fd, buf, 4096, 0, (struct sockaddr*)&addr, &addrLen);
+			DASHEL_PROBE3(udp__receive, this, fd, recvCount);
+			DASHEL_STAT(++statistics.syscalls);
 			if (recvCount <= 0)
+			{
 				fail(DashelException::ConnectionLost, errno, "UDP Socket read I/O error.");
+				return;
+			}
 
-			receptionBuffer.resize(recvCount);
-			std::copy(buf, buf + recvCount, receptionBuffer.begin());
+			setReceived(buf, recvCount);
 
 			source = IPV4Address(ntohl(addr.sin_addr.s_addr), ntohs(addr.sin_port));
 		}
@@ -763,8 +1621,10 @@ namespace Dashel
 
 		virtual bool isDataInRecvBuffer() const
 		{
-			bool ret = selectWasCalled;
+			// coalesced datagrams are pending as long as the user receives them
+			bool ret = selectWasCalled || (receiveWasCalled && coalescedPos < coalescedSize);
 			selectWasCalled = false;
+			receiveWasCalled = false;
 			return ret;
 		}
 	};
@@ -787,23 +1647,29 @@ namespace Dashel
 			if (size == 0)
 				return;
 
+			DASHEL_STAT(++statistics.writeCalls; statistics.bytesOut += size);
+
 			const char* ptr = (const char*)data;
 			size_t left = size;
 
 			while (left)
 			{
 				ssize_t len = ::write(fd, ptr, left);
+				DASHEL_STAT(++statistics.syscalls);
 
 				if (len < 0)
 				{
 					fail(DashelException::IOError, errno, "File write I/O error.");
+					return;
 				}
 				else if (len == 0)
 				{
 					fail(DashelException::ConnectionLost, 0, "File full.");
+					return;
 				}
 				else
 				{
+					DASHEL_STAT(if (size_t(len) < left) ++statistics.shortWrites);
 					ptr += len;
 					left -= len;
 				}
@@ -831,6 +1697,8 @@ namespace Dashel
 			if (size == 0)
 				return;
 
+			DASHEL_STAT(++statistics.readCalls; statistics.bytesIn += size);
+
 			char* ptr = (char*)data;
 			size_t left = size;
 
@@ -846,28 +1714,90 @@ namespace Dashel
 			while (left)
 			{
 				ssize_t len = ::read(fd, ptr, left);
+				DASHEL_STAT(++statistics.syscalls);
 
 				if (len < 0)
 				{
 					fail(DashelException::IOError, errno, "File read I/O error.");
+					return;
 				}
 				else if (len == 0)
 				{
 					fail(DashelException::ConnectionLost, 0, "Reached end of file.");
+					return;
 				}
 				else
 				{
+					DASHEL_STAT(if (size_t(len) < left) ++statistics.shortReads);
 					ptr += len;
 					left -= len;
 				}
 			}
 		}
 
+		virtual size_t readSome(void* data, size_t size)
+		{
+			assert(fd >= 0);
+
+			if (size == 0)
+				return 0;
+
+			char* ptr = (char*)data;
+			size_t left = size;
+
+			if (isDataInRecvBuffer())
+			{
+				size_t toCopy = std::min(recvBufferSize - recvBufferPos, size);
+				memcpy(ptr, recvBuffer + recvBufferPos, toCopy);
+				recvBufferPos += toCopy;
+				ptr += toCopy;
+				left -= toCopy;
+			}
+
+			// only read if it does not block, without changing the blocking mode of the file descriptor
+			struct pollfd pollFd;
+			pollFd.fd = fd;
+			pollFd.events = POLLIN;
+			pollFd.revents = 0;
+#ifndef USE_POLL_EMU
+			if (left && poll(&pollFd, 1, 0) > 0 && (pollFd.revents & POLLIN))
+#else
+			if (left && poll_emu(&pollFd, 1, 0) > 0 && (pollFd.revents & POLLIN))
+#endif
+			{
+				ssize_t len = ::read(fd, ptr, left);
+				DASHEL_STAT(++statistics.syscalls);
+
+				if (len < 0)
+				{
+					if (errno == EAGAIN || errno == EWOULDBLOCK)
+						DASHEL_STAT(++statistics.wouldBlock);
+					else
+						fail(DashelException::IOError, errno, "File read I/O error.");
+				}
+				else if (len == 0)
+				{
+					if (left == size)
+						fail(DashelException::ConnectionLost, 0, "Reached end of file.");
+				}
+				else
+				{
+					DASHEL_STAT(if (size_t(len) < left) ++statistics.shortReads);
+					left -= len;
+				}
+			}
+
+			DASHEL_STAT(++statistics.readCalls; statistics.bytesIn += size - left);
+			return size - left;
+		}
+
 		virtual bool receiveDataAndCheckDisconnection()
 		{
 			assert(recvBufferPos == recvBufferSize);
 
-			ssize_t len = ::read(fd, &recvBuffer, RECV_BUFFER_SIZE);
+			acquireRecvBuffer();
+			ssize_t len = ::read(fd, recvBuffer, RECV_BUFFER_SIZE);
+			DASHEL_STAT(++statistics.syscalls);
 			if (len > 0)
 			{
 				recvBufferSize = len;
@@ -1130,149 +2060,1824 @@ namespace Dashel
 	};
 
 
-	// Hub
+	// Capture and replay
 
-	Hub::Hub(const bool resolveIncomingNames) :
-		resolveIncomingNames(resolveIncomingNames)
+	// clang-format off
+	//! Capture file constants
+	enum CaptureConsts
 	{
-		int* terminationPipes = new int[2];
-		if (pipe(terminationPipes) != 0)
-			abort();
-		hTerminate = terminationPipes;
+		CAPTURE_MAGIC_SIZE = 8,				//!< size of the magic numbers starting the file and ending the index
+		CAPTURE_RECORD_HEADER_SIZE = 13,	//!< timestamp (8 bytes), size (4 bytes) and direction (1 byte) of a record
+		CAPTURE_INDEX_INTERVAL = 1024,		//!< number of records between entries of the index
+		CAPTURE_TRAILER_SIZE = 24			//!< index offset (8 bytes), index entry count (8 bytes) and magic (8 bytes)
+	};
+	// clang-format on
 
-		streamsLock = new pthread_mutex_t;
+	//! Magic number starting capture files
+	static const char captureMagic[CAPTURE_MAGIC_SIZE] = { 'D', 'S', 'H', 'L', 'C', 'A', 'P', '1' };
+	//! Magic number ending the index of capture files
+	static const char captureIndexMagic[CAPTURE_MAGIC_SIZE] = { 'D', 'S', 'H', 'L', 'I', 'D', 'X', '1' };
 
-		pthread_mutex_init((pthread_mutex_t*)streamsLock, NULL);
+	//! Store a value of size bytes in little endian at data
+	static void storeLittleEndian(unsigned char* data, unsigned long long value, size_t size)
+	{
+		for (size_t i = 0; i < size; ++i)
+			data[i] = (unsigned char)(value >> (8 * i));
 	}
 
-	Hub::~Hub()
+	//! Load a little-endian value of size bytes from data
+	static unsigned long long loadLittleEndian(const unsigned char* data, size_t size)
 	{
-		int* terminationPipes = (int*)hTerminate;
-		close(terminationPipes[0]);
-		close(terminationPipes[1]);
-		delete[] terminationPipes;
+		unsigned long long value = 0;
+		for (size_t i = 0; i < size; ++i)
+			value |= (unsigned long long)data[i] << (8 * i);
+		return value;
+	}
 
-		for (StreamsSet::iterator it = streams.begin(); it != streams.end(); ++it)
-			delete *it;
+	//! Write a capture file from a background thread, fed through a single-producer single-consumer ring buffer
+	class CaptureWriter
+	{
+	public:
+		//! Direction of recorded data
+		enum Direction
+		{
+			Incoming = 0, //!< data read from the stream
+			Outgoing = 1 //!< data written to the stream
+		};
 
-		pthread_mutex_destroy((pthread_mutex_t*)streamsLock);
+	protected:
+		FILE* file; //!< capture file
+		std::vector<unsigned char> ring; //!< ring buffer of records, its size is a power of two
+		const size_t ringMask; //!< size of ring minus one
+		std::atomic<size_t> head; //!< amount of data ever pushed to ring, only modified by the producer
+		std::atomic<size_t> tail; //!< amount of data ever written from ring, only modified by the writer thread
+		std::atomic<bool> stopping; //!< whether the writer thread must write the remaining records and stop
+		pthread_t thread; //!< writer thread
+		pthread_mutex_t mutex; //!< mutex for waiting on dataAvailable and spaceAvailable
+		pthread_cond_t dataAvailable; //!< signaled when the writer thread should wake up
+		pthread_cond_t spaceAvailable; //!< signaled by the writer thread when it frees space while the producer waits for some
+		std::atomic<bool> producerWaiting; //!< whether the producer waits on spaceAvailable for the ring to have enough space
+		bool writeFailed; //!< whether writing to the file failed, in which case records are dropped
+		unsigned long long fileOffset; //!< position of the next record in the file
+		unsigned long long recordCount; //!< number of records written
+		std::vector<unsigned long long> index; //!< file offset and timestamp of every CAPTURE_INDEX_INTERVAL record
 
-		delete (pthread_mutex_t*)streamsLock;
-	}
+	public:
+		//! Create the file and start the writer thread, the ring holds at least bufferSize bytes
+		CaptureWriter(const std::string& fileName, size_t bufferSize) :
+			file(fopen(fileName.c_str(), "wb")),
+			ring(roundToPowerOfTwo(std::max<size_t>(bufferSize, 65536))),
+			ringMask(ring.size() - 1),
+			head(0),
+			tail(0),
+			stopping(false),
+			producerWaiting(false),
+			writeFailed(false),
+			fileOffset(CAPTURE_MAGIC_SIZE),
+			recordCount(0)
+		{
+			if (!file)
+				throw DashelException(DashelException::ConnectionFailed, errno, "Cannot create capture file.");
+			if (fwrite(captureMagic, 1, CAPTURE_MAGIC_SIZE, file) != CAPTURE_MAGIC_SIZE)
+			{
+				fclose(file);
+				throw DashelException(DashelException::IOError, errno, "Cannot write capture file.");
+			}
 
-	Stream* Hub::connect(const std::string& target)
-	{
-		std::string proto;
-		size_t c = target.find_first_of(':');
-		if (c == std::string::npos)
-			throw DashelException(DashelException::InvalidTarget, 0, "No protocol specified in target.");
-		proto = target.substr(0, c);
-		// N.B. params = target.substr(c+1)
+			pthread_mutex_init(&mutex, NULL);
+			pthread_cond_init(&dataAvailable, NULL);
+			pthread_cond_init(&spaceAvailable, NULL);
+			if (pthread_create(&thread, NULL, &runWriter, this) != 0)
+			{
+				pthread_cond_destroy(&spaceAvailable);
+				pthread_cond_destroy(&dataAvailable);
+				pthread_mutex_destroy(&mutex);
+				fclose(file);
+				throw DashelException(DashelException::ConnectionFailed, 0, "Cannot start capture thread.");
+			}
+		}
 
-		SelectableStream* s(dynamic_cast<SelectableStream*>(streamTypeRegistry.create(proto, target, *this)));
-		if (!s)
+		//! Write the remaining records and the index, and close the file
+		~CaptureWriter()
 		{
-			std::string r = "Invalid protocol in target: ";
-			r += proto;
-			r += ", known protocol are: ";
-			r += streamTypeRegistry.list();
-			throw DashelException(DashelException::InvalidTarget, 0, r.c_str());
+			pthread_mutex_lock(&mutex);
+			stopping.store(true, std::memory_order_release);
+			pthread_cond_signal(&dataAvailable);
+			pthread_mutex_unlock(&mutex);
+			pthread_join(thread, NULL);
+
+			pthread_cond_destroy(&spaceAvailable);
+			pthread_cond_destroy(&dataAvailable);
+			pthread_mutex_destroy(&mutex);
+			fclose(file);
 		}
 
-		/* The caller must have the stream lock held */
+		//! Record data, only waits if the writer thread is late by the whole ring
+		void push(Direction direction, const void* data, size_t size)
+		{
+			const unsigned long long timestamp(monotonicNanoseconds());
+			const unsigned char* ptr = (const unsigned char*)data;
+			// split large data so that any record fits in half the ring
+			const size_t maxRecordSize(ring.size() / 2 - CAPTURE_RECORD_HEADER_SIZE);
+			do
+			{
+				const size_t recordSize(std::min(size, maxRecordSize));
+				const size_t needed(CAPTURE_RECORD_HEADER_SIZE + recordSize);
+				const size_t start(head.load(std::memory_order_relaxed));
+				if (ring.size() - (start - tail.load(std::memory_order_acquire)) < needed)
+					waitForSpace(start, needed);
+
+				unsigned char header[CAPTURE_RECORD_HEADER_SIZE];
+				storeLittleEndian(header, timestamp, 8);
+				storeLittleEndian(header + 8, recordSize, 4);
+				header[12] = (unsigned char)direction;
+				copyToRing(start, header, CAPTURE_RECORD_HEADER_SIZE);
+				copyToRing(start + CAPTURE_RECORD_HEADER_SIZE, ptr, recordSize);
+				head.store(start + needed, std::memory_order_release);
+
+				// wake the writer thread when the ring becomes a quarter full, otherwise it wakes up periodically
+				const size_t used(start + needed - tail.load(std::memory_order_relaxed));
+				if (used >= ring.size() / 4 && used - needed < ring.size() / 4)
+					pthread_cond_signal(&dataAvailable);
+
+				ptr += recordSize;
+				size -= recordSize;
+			} while (size);
+		}
 
-		streams.insert(s);
-		if (proto != "tcpin")
+	protected:
+		//! Wake the writer thread and sleep until the ring has room for needed bytes after position start
+		void waitForSpace(size_t start, size_t needed)
 		{
-			dataStreams.insert(s);
-			connectionCreated(s);
+			pthread_mutex_lock(&mutex);
+			producerWaiting.store(true);
+			// pairs with the fence of the writer thread, so that either it sees producerWaiting or we see its new tail
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			while (ring.size() - (start - tail.load(std::memory_order_acquire)) < needed)
+			{
+				pthread_cond_signal(&dataAvailable);
+				pthread_cond_wait(&spaceAvailable, &mutex);
+			}
+			producerWaiting.store(false);
+			pthread_mutex_unlock(&mutex);
 		}
 
-		return s;
-	}
+		//! Return the smallest power of two larger or equal to value
+		static size_t roundToPowerOfTwo(size_t value)
+		{
+			size_t result = 1;
+			while (result < value)
+				result <<= 1;
+			return result;
+		}
 
-	void Hub::run()
-	{
-		while (step(-1))
-			;
-	}
+		//! Copy data to the ring at position pos, wrapping around its end
+		void copyToRing(size_t pos, const unsigned char* data, size_t size)
+		{
+			const size_t offset(pos & ringMask);
+			const size_t first(std::min(size, ring.size() - offset));
+			memcpy(&ring[offset], data, first);
+			memcpy(&ring[0], data + first, size - first);
+		}
 
-	bool Hub::step(const int timeout)
-	{
-		bool firstPoll = true;
+		//! Copy data from the ring at position pos, wrapping around its end
+		void copyFromRing(size_t pos, unsigned char* data, size_t size) const
+		{
+			const size_t offset(pos & ringMask);
+			const size_t first(std::min(size, ring.size() - offset));
+			memcpy(data, &ring[offset], first);
+			memcpy(data + first, &ring[0], size - first);
+		}
+
+		//! Write size bytes of the ring at position pos to the file
+		void writeFromRing(size_t pos, size_t size)
+		{
+			const size_t offset(pos & ringMask);
+			const size_t first(std::min(size, ring.size() - offset));
+			if (fwrite(&ring[offset], 1, first, file) != first || fwrite(&ring[0], 1, size - first, file) != size - first)
+				writeFailed = true;
+		}
+
+		//! Entry point of the writer thread
+		static void* runWriter(void* writer)
+		{
+			static_cast<CaptureWriter*>(writer)->writeRecords();
+			return 0;
+		}
+
+		//! Write records as they are pushed, then the index once stopping is set
+		void writeRecords()
+		{
+			while (true)
+			{
+				const bool finishing(stopping.load(std::memory_order_acquire));
+				size_t pos(tail.load(std::memory_order_relaxed));
+				const size_t end(head.load(std::memory_order_acquire));
+				if (pos == end)
+				{
+					if (finishing)
+						break;
+
+					// wait for records, at most 10 ms
+					struct timespec deadline;
+					clock_gettime(CLOCK_REALTIME, &deadline);
+					deadline.tv_nsec += 10000000;
+					if (deadline.tv_nsec >= 1000000000)
+					{
+						deadline.tv_sec += 1;
+						deadline.tv_nsec -= 1000000000;
+					}
+					pthread_mutex_lock(&mutex);
+					if (!stopping.load(std::memory_order_acquire))
+						pthread_cond_timedwait(&dataAvailable, &mutex, &deadline);
+					pthread_mutex_unlock(&mutex);
+					continue;
+				}
+
+				while (pos != end)
+				{
+					unsigned char header[CAPTURE_RECORD_HEADER_SIZE];
+					copyFromRing(pos, header, CAPTURE_RECORD_HEADER_SIZE);
+					const size_t recordSize(CAPTURE_RECORD_HEADER_SIZE + loadLittleEndian(header + 8, 4));
+					if (!writeFailed)
+					{
+						if (recordCount % CAPTURE_INDEX_INTERVAL == 0)
+						{
+							index.push_back(fileOffset);
+							index.push_back(loadLittleEndian(header, 8));
+						}
+						writeFromRing(pos, recordSize);
+						fileOffset += recordSize;
+						++recordCount;
+					}
+					pos += recordSize;
+					tail.store(pos, std::memory_order_release);
+
+					// the producer only sleeps when the ring is full, so it is not woken up otherwise
+					std::atomic_thread_fence(std::memory_order_seq_cst);
+					if (producerWaiting.load(std::memory_order_relaxed))
+					{
+						pthread_mutex_lock(&mutex);
+						pthread_cond_signal(&spaceAvailable);
+						pthread_mutex_unlock(&mutex);
+					}
+				}
+			}
+
+			// write the index and the trailer locating it
+			if (writeFailed)
+				return;
+			std::vector<unsigned char> trailer(index.size() * 8 + CAPTURE_TRAILER_SIZE);
+			for (size_t i = 0; i < index.size(); ++i)
+				storeLittleEndian(&trailer[i * 8], index[i], 8);
+			unsigned char* end(&trailer[index.size() * 8]);
+			storeLittleEndian(end, fileOffset, 8);
+			storeLittleEndian(end + 8, index.size() / 2, 8);
+			memcpy(end + 16, captureIndexMagic, CAPTURE_MAGIC_SIZE);
+			fwrite(&trailer[0], 1, trailer.size(), file);
+		}
+	};
+
+	//! Wrap a byte stream, recording all data read from and written to it into a capture file
+	class RecordStream : public SelectableStream
+	{
+	protected:
+		SelectableStream* inner; //!< the recorded stream
+		CaptureWriter* capture; //!< the writer of the capture file
+
+	public:
+		//! Create the inner stream and the capture file
+		RecordStream(const std::string& targetName, const Hub& hub) :
+			Stream("record"),
+			SelectableStream("record"),
+			inner(0),
+			capture(0)
+		{
+			// the inner target contains separators, so it must be the last parameter
+			const size_t innerPos(targetName.find("inner="));
+			if (innerPos == std::string::npos)
+				throw DashelException(DashelException::InvalidTarget, 0, "Missing inner target to record.");
+			const std::string innerTarget(targetName.substr(innerPos + 6));
+			target.add("record:file=capture.dcap;bufferSize=4194304");
+			target.add(targetName.substr(0, innerPos).c_str());
+			target.addParam("inner", innerTarget.c_str());
+
+			const size_t c(innerTarget.find(':'));
+			if (c == std::string::npos)
+				throw DashelException(DashelException::InvalidTarget, 0, "No protocol specified in inner target.");
+			Stream* stream(streamTypeRegistry.create(innerTarget.substr(0, c), innerTarget, hub));
+			if (!stream)
+				throw DashelException(DashelException::InvalidTarget, 0, "Invalid protocol in inner target.");
+			inner = polymorphic_downcast<SelectableStream*>(stream);
+			if (dynamic_cast<SocketServerStream*>(inner) || dynamic_cast<PacketStream*>(inner))
+			{
+				delete inner;
+				throw DashelException(DashelException::InvalidTarget, 0, "Inner target of record is not a byte stream.");
+			}
+
+			try
+			{
+				capture = new CaptureWriter(target.get("file"), target.get<unsigned>("bufferSize"));
+			}
+			catch (...)
+			{
+				delete inner;
+				throw;
+			}
+			shareFileDescriptor(*inner);
+		}
+
+		virtual ~RecordStream()
+		{
+			// the file descriptor belongs to the inner stream
+			fd = -1;
+			delete inner;
+			delete capture;
+		}
+
+		virtual void write(const void* data, const size_t size)
+		{
+			try
+			{
+				inner->write(data, size);
+			}
+			catch (const DashelException& e)
+			{
+				fail(e.source, 0, inner->getFailReason().c_str());
+				return;
+			}
+			capture->push(CaptureWriter::Outgoing, data, size);
+		}
+
+		virtual void writeShared(const SharedBuffer& buffer)
+		{
+			try
+			{
+				inner->writeShared(buffer);
+			}
+			catch (const DashelException& e)
+			{
+				fail(e.source, 0, inner->getFailReason().c_str());
+				return;
+			}
+			capture->push(CaptureWriter::Outgoing, buffer.data(), buffer.size());
+		}
+
+		virtual void flush()
+		{
+			try
+			{
+				inner->flush();
+			}
+			catch (const DashelException& e)
+			{
+				fail(e.source, 0, inner->getFailReason().c_str());
+			}
+		}
+
+		virtual void read(void* data, size_t size)
+		{
+			try
+			{
+				inner->read(data, size);
+			}
+			catch (const DashelException& e)
+			{
+				fail(e.source, 0, inner->getFailReason().c_str());
+				return;
+			}
+			capture->push(CaptureWriter::Incoming, data, size);
+		}
+
+		virtual size_t readSome(void* data, size_t size)
+		{
+			size_t received = 0;
+			try
+			{
+				received = inner->readSome(data, size);
+			}
+			catch (const DashelException& e)
+			{
+				fail(e.source, 0, inner->getFailReason().c_str());
+			}
+			if (received)
+				capture->push(CaptureWriter::Incoming, data, received);
+			return received;
+		}
+
+		virtual bool receiveDataAndCheckDisconnection()
+		{
+			try
+			{
+				return inner->receiveDataAndCheckDisconnection();
+			}
+			catch (const DashelException& e)
+			{
+				fail(e.source, 0, inner->getFailReason().c_str());
+			}
+			return true;
+		}
+
+		virtual bool isDataInRecvBuffer() const { return inner->isDataInRecvBuffer(); }
+
+		virtual const unsigned char* takeRecvBuffer(size_t& size)
+		{
+			const unsigned char* data(inner->takeRecvBuffer(size));
+			if (size)
+				capture->push(CaptureWriter::Incoming, data, size);
+			return data;
+		}
+
+		virtual bool supportsFraming() const { return inner->supportsFraming(); }
+
+		virtual void setBufferPool(BufferPool* pool)
+		{
+			bufferPool = pool;
+			inner->setBufferPool(pool);
+		}
+
+		virtual void releaseRecvBuffer() { inner->releaseRecvBuffer(); }
+	};
+
+	//! Read-only stream feeding the incoming data of a capture file, with their recorded timing
+	class ReplayStream : public FileDescriptorStream
+	{
+	protected:
+		FILE* file; //!< capture file
+		unsigned long long recordsEnd; //!< offset of the end of records in the capture file
+		double speed; //!< replay speed relative to the recording, 0 for as fast as possible
+		int threadFd; //!< end of the socket pair written by the replay thread
+		pthread_t thread; //!< replay thread
+
+	public:
+		//! Open the capture file and start the replay thread
+		explicit ReplayStream(const std::string& targetName) :
+			Stream("replay"),
+			FileDescriptorStream("replay"),
+			file(0),
+			threadFd(-1)
+		{
+			target.add("replay:file;speed=1");
+			target.add(targetName.c_str());
+
+			speed = target.get("speed") == "max" ? 0 : target.get<double>("speed");
+			if (!(speed >= 0))
+				throw DashelException(DashelException::InvalidTarget, 0, "Replay speed must be positive or max.");
+
+			file = fopen(target.get("file").c_str(), "rb");
+			if (!file)
+				throw DashelException(DashelException::ConnectionFailed, errno, "Cannot open capture file.");
+			char magic[CAPTURE_MAGIC_SIZE];
+			if (fread(magic, 1, CAPTURE_MAGIC_SIZE, file) != CAPTURE_MAGIC_SIZE || memcmp(magic, captureMagic, CAPTURE_MAGIC_SIZE) != 0)
+			{
+				fclose(file);
+				throw DashelException(DashelException::InvalidTarget, 0, "File is not a capture file.");
+			}
+			recordsEnd = findRecordsEnd();
+
+			int sockets[2];
+			if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+			{
+				fclose(file);
+				throw DashelException(DashelException::ConnectionFailed, errno, "Cannot create replay socket pair.");
+			}
+			fd = sockets[0];
+			threadFd = sockets[1];
+			if (pthread_create(&thread, NULL, &runReplay, this) != 0)
+			{
+				close(threadFd);
+				fclose(file);
+				throw DashelException(DashelException::ConnectionFailed, 0, "Cannot start replay thread.");
+			}
+		}
+
+		virtual ~ReplayStream()
+		{
+			// wakes the replay thread up if it is waiting or sending
+			shutdown(fd, SHUT_RDWR);
+			pthread_join(thread, NULL);
+			close(threadFd);
+			fclose(file);
+		}
+
+		// clang-format off
+		virtual void write(const void* data, const size_t size) { /* data written to a replay are discarded */ }
+		virtual void flush() { /* hook for use by derived classes */ }
+		// clang-format on
+
+	protected:
+		//! Return the offset of the end of records, using the trailer if the recording completed
+		unsigned long long findRecordsEnd()
+		{
+			unsigned long long end = CAPTURE_MAGIC_SIZE;
+			if (fseeko(file, 0, SEEK_END) == 0)
+				end = ftello(file);
+			unsigned char trailer[CAPTURE_TRAILER_SIZE];
+			if (end >= CAPTURE_MAGIC_SIZE + CAPTURE_TRAILER_SIZE &&
+				fseeko(file, end - CAPTURE_TRAILER_SIZE, SEEK_SET) == 0 &&
+				fread(trailer, 1, CAPTURE_TRAILER_SIZE, file) == CAPTURE_TRAILER_SIZE &&
+				memcmp(trailer + 16, captureIndexMagic, CAPTURE_MAGIC_SIZE) == 0)
+				end = std::min(end, loadLittleEndian(trailer, 8));
+			fseeko(file, CAPTURE_MAGIC_SIZE, SEEK_SET);
+			return end;
+		}
+
+		//! Entry point of the replay thread
+		static void* runReplay(void* stream)
+		{
+			static_cast<ReplayStream*>(stream)->replay();
+			return 0;
+		}
+
+		//! Send the incoming data of all records, then close the writing side of the socket pair
+		void replay()
+		{
+			const unsigned long long start(monotonicNanoseconds());
+			unsigned long long firstTimestamp = 0;
+			unsigned long long offset = CAPTURE_MAGIC_SIZE;
+			std::vector<unsigned char> data;
+			unsigned char header[CAPTURE_RECORD_HEADER_SIZE];
+			while (offset + CAPTURE_RECORD_HEADER_SIZE <= recordsEnd && fread(header, 1, CAPTURE_RECORD_HEADER_SIZE, file) == CAPTURE_RECORD_HEADER_SIZE)
+			{
+				const size_t size(loadLittleEndian(header + 8, 4));
+				offset += CAPTURE_RECORD_HEADER_SIZE + size;
+				if (offset > recordsEnd)
+					break;
+				data.resize(size);
+				if (size && fread(&data[0], 1, size, file) != size)
+					break;
+				if (header[12] != CaptureWriter::Incoming)
+					continue;
+
+				const unsigned long long timestamp(loadLittleEndian(header, 8));
+				if (firstTimestamp == 0)
+					firstTimestamp = timestamp;
+				if (speed > 0 && !waitUntil(start + (unsigned long long)((timestamp - firstTimestamp) / speed)))
+					return;
+				if (!sendAll(&data[0], size))
+					return;
+			}
+			shutdown(threadFd, SHUT_WR);
+		}
+
+		//! Wait until the monotonic clock reaches deadline, return false if the stream was closed meanwhile
+		bool waitUntil(unsigned long long deadline)
+		{
+			unsigned long long now;
+			while ((now = monotonicNanoseconds()) < deadline)
+			{
+				const unsigned long long left(deadline - now);
+				if (left >= 1000000)
+				{
+					// the reader never writes, so the socket only becomes readable when it is shut down
+					struct pollfd pollFd;
+					pollFd.fd = threadFd;
+					pollFd.events = POLLIN;
+					pollFd.revents = 0;
+					if (pollFileDescriptors(&pollFd, 1, int(std::min<unsigned long long>(left / 1000000, 1000))) != 0)
+						return false;
+				}
+				else
+				{
+					struct timespec delay;
+					delay.tv_sec = 0;
+					delay.tv_nsec = long(left);
+					nanosleep(&delay, NULL);
+				}
+			}
+			return true;
+		}
+
+		//! Send data to the reading side of the socket pair, return false if it was closed
+		bool sendAll(const unsigned char* data, size_t size)
+		{
+			while (size)
+			{
+#ifdef MACOSX
+				const ssize_t len = ::send(threadFd, data, size, 0);
+#else
+				const ssize_t len = ::send(threadFd, data, size, MSG_NOSIGNAL);
+#endif
+				if (len <= 0)
+					return false;
+				data += len;
+				size -= len;
+			}
+			return true;
+		}
+	};
+
+
+	// Network simulation
+
+	//! Wrapper around a packet stream, that delays, drops, reorders and throttles packets to simulate a constrained link
+	/*!
+		Packets go through a simulated link in each direction: they wait for the link to be free at the given bandwidth,
+		then they travel with the given latency and jitter. The Hub serves the stream when a packet reaches the end of the link,
+		using nextDeadline().
+	*/
+	class NetSimStream : public MemoryPacketStream, public SelectableStream
+	{
+	protected:
+		//! A packet travelling on the simulated link
+		struct Packet
+		{
+			IPV4Address address; //!< destination of outgoing packets, source of incoming packets
+			std::vector<unsigned char> data; //!< payload
+		};
+		//! Packets by time of arrival at the end of the link; packets with the same time keep their order
+		typedef std::multimap<unsigned long long, Packet> PacketQueue;
+
+		//! Simulated link in one direction
+		struct Link
+		{
+			PacketQueue packets; //!< packets on the link
+			unsigned long long freeTime; //!< time at which the link has finished transmitting the queued packets
+			unsigned long long lastArrival; //!< time of arrival of the last packet, to keep order despite jitter
+
+			Link() :
+				freeTime(0),
+				lastArrival(0)
+			{}
+		};
+
+		SelectableStream* inner; //!< the packet stream whose traffic is simulated
+		PacketStream* innerPacket; //!< inner, as a packet stream
+		bool simulateOut; //!< whether outgoing packets go through the simulated link
+		bool simulateIn; //!< whether incoming packets go through the simulated link
+		unsigned long long latency; //!< one-way latency in nanoseconds
+		unsigned long long jitter; //!< maximum deviation from latency in nanoseconds
+		double bandwidth; //!< link bandwidth in bits per second, 0 for unlimited
+		double loss; //!< probability to drop a packet
+		double reorder; //!< probability for a packet to skip latency and jitter, overtaking the packets in flight
+		size_t queueLimit; //!< maximum number of packets on each link, further packets being dropped
+		unsigned long long randomState; //!< state of the xorshift random generator
+		Link outLink; //!< link for outgoing packets
+		Link inLink; //!< link for incoming packets
+		std::deque<Packet> arrived; //!< incoming packets that reached the end of the link, to be returned by receive()
+		std::vector<unsigned char> receptionScratch; //!< payload of the last packet received from the inner stream, large enough for any datagram
+		mutable bool selectWasCalled; //!< whether the Hub served this stream since the last call to isDataInRecvBuffer()
+		mutable bool receiveWasCalled; //!< whether receive() was called since the last call to isDataInRecvBuffer()
+
+	public:
+		//! Create the inner stream and set the link parameters
+		NetSimStream(const std::string& targetName, const Hub& hub) :
+			Stream("netsim"),
+			MemoryPacketStream("netsim"),
+			SelectableStream("netsim"),
+			inner(0),
+			innerPacket(0),
+			receptionScratch(65536),
+			selectWasCalled(false),
+			receiveWasCalled(false)
+		{
+			// the inner target contains separators, so it must be the last parameter
+			const size_t innerPos(targetName.find("inner="));
+			if (innerPos == std::string::npos)
+				throw DashelException(DashelException::InvalidTarget, 0, "Missing inner target to simulate.");
+			const std::string innerTarget(targetName.substr(innerPos + 6));
+			target.add("netsim:latency=0;jitter=0;bw=0;loss=0;reorder=0;queue=1000;direction=both;seed=1");
+			target.add(targetName.substr(0, innerPos).c_str());
+			target.addParam("inner", innerTarget.c_str());
+
+			const std::string direction(target.get("direction"));
+			if (direction != "both" && direction != "out" && direction != "in")
+				throw DashelException(DashelException::InvalidTarget, 0, "Invalid direction, must be both, out or in.");
+			simulateOut = (direction != "in");
+			simulateIn = (direction != "out");
+			latency = (unsigned long long)(std::max(0., target.get<double>("latency")) * 1e6);
+			jitter = (unsigned long long)(std::max(0., target.get<double>("jitter")) * 1e6);
+			bandwidth = std::max(0., target.get<double>("bw"));
+			loss = target.get<double>("loss");
+			reorder = target.get<double>("reorder");
+			queueLimit = target.get<size_t>("queue");
+			randomState = target.get<unsigned long long>("seed") | 1;
+
+			const size_t c(innerTarget.find(':'));
+			if (c == std::string::npos)
+				throw DashelException(DashelException::InvalidTarget, 0, "No protocol specified in inner target.");
+			Stream* stream(streamTypeRegistry.create(innerTarget.substr(0, c), innerTarget, hub));
+			if (!stream)
+				throw DashelException(DashelException::InvalidTarget, 0, "Invalid protocol in inner target.");
+			inner = polymorphic_downcast<SelectableStream*>(stream);
+			innerPacket = dynamic_cast<PacketStream*>(inner);
+			if (!innerPacket)
+			{
+				delete inner;
+				throw DashelException(DashelException::InvalidTarget, 0, "Inner target of netsim is not a packet stream.");
+			}
+			shareFileDescriptor(*inner);
+		}
+
+		virtual ~NetSimStream()
+		{
+			// the file descriptor belongs to the inner stream
+			fd = -1;
+			delete inner;
+		}
+
+		virtual void send(const IPV4Address& dest)
+		{
+			DASHEL_STAT(++statistics.writeCalls; statistics.bytesOut += sendBuffer.size());
+			Packet packet;
+			packet.address = dest;
+			packet.data.assign(sendBuffer.get(), sendBuffer.get() + sendBuffer.size());
+			clearSendBuffer();
+			if (simulateOut)
+			{
+				enqueue(outLink, packet);
+				sendArrived();
+			}
+			else
+				sendToInner(packet);
+		}
+
+		virtual void receive(IPV4Address& source)
+		{
+			receiveWasCalled = true;
+
+			// wait until a packet reaches the end of the link
+			while (arrived.empty())
+			{
+				const unsigned long long deadline(inLink.packets.empty() ? 0 : inLink.packets.begin()->first);
+				const unsigned long long now(monotonicNanoseconds());
+				if (deadline && deadline <= now)
+				{
+					collectArrived(now);
+					continue;
+				}
+				struct pollfd pollFd;
+				pollFd.fd = fd;
+				pollFd.events = POLLIN;
+				pollFd.revents = 0;
+				const int timeout(deadline ? int((deadline - now + 999999) / 1000000) : -1);
+				if (pollFileDescriptors(&pollFd, 1, timeout) > 0)
+					receiveFromInner(1);
+			}
+
+			Packet& packet(arrived.front());
+			setReceived(packet.data.empty() ? 0 : &packet.data[0], packet.data.size());
+			source = packet.address;
+			arrived.pop_front();
+			DASHEL_STAT(++statistics.readCalls; statistics.bytesIn += receptionBuffer.size());
+		}
+
+		virtual bool receiveDataAndCheckDisconnection()
+		{
+			selectWasCalled = true;
+			sendArrived();
+			receiveFromInner(64);
+			collectArrived(monotonicNanoseconds());
+			return false;
+		}
+
+		virtual bool isDataInRecvBuffer() const
+		{
+			// arrived packets are pending as long as the user receives them
+			bool ret = (selectWasCalled || receiveWasCalled) && !arrived.empty();
+			selectWasCalled = false;
+			receiveWasCalled = false;
+			return ret;
+		}
+
+		virtual unsigned long long nextDeadline() const
+		{
+			unsigned long long deadline(0);
+			if (!outLink.packets.empty())
+				deadline = outLink.packets.begin()->first;
+			if (!inLink.packets.empty() && (!deadline || inLink.packets.begin()->first < deadline))
+				deadline = inLink.packets.begin()->first;
+			return deadline;
+		}
+
+	protected:
+		//! Return a random number uniformly distributed in [0, 1)
+		double uniformRandom()
+		{
+			randomState ^= randomState << 13;
+			randomState ^= randomState >> 7;
+			randomState ^= randomState << 17;
+			return (randomState >> 11) * (1.0 / 9007199254740992.0);
+		}
+
+		//! Put a packet on a link, unless it is lost or the link is full
+		void enqueue(Link& link, Packet& packet)
+		{
+			if ((loss > 0 && uniformRandom() < loss) || link.packets.size() >= queueLimit)
+				return;
+
+			const unsigned long long now(monotonicNanoseconds());
+			link.freeTime = std::max(link.freeTime, now);
+			if (bandwidth > 0)
+				link.freeTime += (unsigned long long)(packet.data.size() * 8e9 / bandwidth);
+
+			// packets chosen for reordering skip latency and jitter, overtaking the packets in flight
+			unsigned long long arrival(link.freeTime);
+			if (reorder <= 0 || uniformRandom() >= reorder)
+			{
+				arrival += latency;
+				if (jitter)
+					arrival = std::max(arrival + (unsigned long long)(uniformRandom() * 2 * jitter), jitter) - jitter;
+				arrival = std::max(arrival, link.lastArrival);
+				link.lastArrival = arrival;
+			}
+
+			// a deadline of 0 means no deadline
+			PacketQueue::iterator it(link.packets.insert(std::make_pair(std::max(arrival, 1ULL), Packet())));
+			it->second.address = packet.address;
+			it->second.data.swap(packet.data);
+		}
+
+		//! Send the outgoing packets that reached the end of the link through the inner stream
+		void sendArrived()
+		{
+			const unsigned long long now(monotonicNanoseconds());
+			while (!outLink.packets.empty() && outLink.packets.begin()->first <= now)
+			{
+				sendToInner(outLink.packets.begin()->second);
+				outLink.packets.erase(outLink.packets.begin());
+			}
+		}
+
+		//! Send a packet through the inner stream
+		void sendToInner(const Packet& packet)
+		{
+			try
+			{
+				if (!packet.data.empty())
+					inner->write(&packet.data[0], packet.data.size());
+				innerPacket->send(packet.address);
+			}
+			catch (const DashelException& e)
+			{
+				fail(e.source, 0, inner->getFailReason().c_str());
+			}
+		}
+
+		//! Receive at most maxCount packets from the inner stream, as long as some are available without blocking
+		void receiveFromInner(unsigned maxCount)
+		{
+			struct pollfd pollFd;
+			pollFd.fd = fd;
+			pollFd.events = POLLIN;
+			for (unsigned i = 0; i < maxCount; ++i)
+			{
+				pollFd.revents = 0;
+				if (pollFileDescriptors(&pollFd, 1, 0) <= 0 || !(pollFd.revents & POLLIN))
+					return;
+
+				// packets only take the memory of their payload, which is copied out of the scratch buffer
+				Packet packet;
+				try
+				{
+					innerPacket->receive(packet.address);
+					const size_t size(inner->readSome(&receptionScratch[0], receptionScratch.size()));
+					packet.data.assign(receptionScratch.begin(), receptionScratch.begin() + size);
+				}
+				catch (const DashelException& e)
+				{
+					fail(e.source, 0, inner->getFailReason().c_str());
+					return;
+				}
+				if (simulateIn)
+					enqueue(inLink, packet);
+				else
+				{
+					arrived.push_back(Packet());
+					arrived.back().address = packet.address;
+					arrived.back().data.swap(packet.data);
+				}
+			}
+		}
+
+		//! Move the incoming packets that reached the end of the link to the arrived packets
+		void collectArrived(unsigned long long now)
+		{
+			while (!inLink.packets.empty() && inLink.packets.begin()->first <= now)
+			{
+				arrived.push_back(Packet());
+				arrived.back().address = inLink.packets.begin()->second.address;
+				arrived.back().data.swap(inLink.packets.begin()->second.data);
+				inLink.packets.erase(inLink.packets.begin());
+			}
+		}
+	};
+
+	// In-process memory transport
+
+	//! Create a wakeup object, fds[0] to poll and read, fds[1] to signal; both are non-blocking
+	static void createWakeup(int fds[2])
+	{
+#ifdef __linux__
+		fds[0] = fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (fds[0] < 0)
+			throw DashelException(DashelException::ConnectionFailed, errno, "Cannot create wakeup event.");
+#else
+		if (pipe(fds) != 0)
+			throw DashelException(DashelException::ConnectionFailed, errno, "Cannot create wakeup pipe.");
+		fcntl(fds[0], F_SETFL, O_NONBLOCK);
+		fcntl(fds[1], F_SETFL, O_NONBLOCK);
+#endif
+	}
+
+	//! Make the wakeup object whose signaling side is fd readable
+	static void signalWakeup(int fd)
+	{
+#ifdef __linux__
+		const uint64_t one = 1;
+		const ssize_t ret = ::write(fd, &one, sizeof(one));
+#else
+		const char one = 1;
+		const ssize_t ret = ::write(fd, &one, sizeof(one));
+#endif
+		(void)ret; // if the counter or pipe is full, the wakeup is already pending
+	}
+
+	//! Consume all signals of the wakeup object whose polled side is fd
+	static void clearWakeup(int fd)
+	{
+		char buffer[64];
+		while (::read(fd, buffer, sizeof(buffer)) > 0)
+			;
+	}
+
+	//! Close a wakeup object created by createWakeup()
+	static void closeWakeup(const int fds[2])
+	{
+		close(fds[0]);
+		if (fds[1] != fds[0])
+			close(fds[1]);
+	}
+
+	//! Unbounded lock-free byte queue for a single producer and a single consumer, made of a linked list of blocks
+	class MemoryQueue
+	{
+	protected:
+		// clang-format off
+		//! Queue constants
+		enum Consts
+		{
+			BLOCK_SIZE = 65536 - 64 //!< amount of data in a block
+		};
+		// clang-format on
+
+		//! A block of data, filled by the producer and emptied by the consumer
+		struct Block
+		{
+			std::atomic<size_t> used; //!< amount of data written to the block
+			std::atomic<Block*> next; //!< next block, once this one is full
+			unsigned char data[BLOCK_SIZE]; //!< data
+
+			Block() :
+				used(0),
+				next(0)
+			{}
+		};
+
+		Block* readBlock; //!< block being read, only accessed by the consumer
+		size_t readPos; //!< position of the next byte to read in readBlock
+		Block* writeBlock; //!< block being written, only accessed by the producer
+		std::atomic<Block*> spareBlock; //!< a block emptied by the consumer, reused by the producer
+
+	public:
+		//! Constructor, creates an empty queue
+		MemoryQueue() :
+			readBlock(new Block),
+			readPos(0),
+			writeBlock(readBlock),
+			spareBlock(0)
+		{}
+
+		//! Destructor, frees all blocks
+		~MemoryQueue()
+		{
+			while (readBlock)
+			{
+				Block* next(readBlock->next.load(std::memory_order_relaxed));
+				delete readBlock;
+				readBlock = next;
+			}
+			delete spareBlock.load(std::memory_order_relaxed);
+		}
+
+		//! Append data, called by the producer
+		void push(const void* data, size_t size)
+		{
+			const unsigned char* ptr = (const unsigned char*)data;
+			while (size)
+			{
+				const size_t used(writeBlock->used.load(std::memory_order_relaxed));
+				if (used == BLOCK_SIZE)
+				{
+					Block* block(spareBlock.exchange(0, std::memory_order_acquire));
+					if (block)
+					{
+						block->used.store(0, std::memory_order_relaxed);
+						block->next.store(0, std::memory_order_relaxed);
+					}
+					else
+						block = new Block;
+					writeBlock->next.store(block, std::memory_order_release);
+					writeBlock = block;
+					continue;
+				}
+				const size_t amount(std::min(size, BLOCK_SIZE - used));
+				memcpy(writeBlock->data + used, ptr, amount);
+				writeBlock->used.store(used + amount, std::memory_order_release);
+				ptr += amount;
+				size -= amount;
+			}
+		}
+
+		//! Remove up to size bytes and copy them to data, return the amount copied; called by the consumer
+		size_t pop(void* data, size_t size)
+		{
+			unsigned char* ptr = (unsigned char*)data;
+			size_t copied = 0;
+			while (copied < size)
+			{
+				const size_t available(readBlock->used.load(std::memory_order_acquire) - readPos);
+				if (available)
+				{
+					const size_t amount(std::min(size - copied, available));
+					memcpy(ptr + copied, readBlock->data + readPos, amount);
+					readPos += amount;
+					copied += amount;
+					continue;
+				}
+				// the producer only links the next block once this one is full
+				Block* next(readBlock->next.load(std::memory_order_acquire));
+				if (!next)
+					break;
+				delete spareBlock.exchange(readBlock, std::memory_order_release);
+				readBlock = next;
+				readPos = 0;
+			}
+			return copied;
+		}
+
+		//! Return whether there is no data to pop, called by the consumer
+		bool empty() const
+		{
+			return readBlock->used.load(std::memory_order_acquire) == readPos && !readBlock->next.load(std::memory_order_acquire);
+		}
+	};
+
+	//! Shared state of the two ends of an in-process connection, that may be used by different threads
+	struct MemoryConnection
+	{
+		MemoryQueue queues[2]; //!< queues[i] holds the data to be read by end i
+		std::atomic<bool> closed[2]; //!< whether end i is closed
+		std::atomic<bool> wakeupPending[2]; //!< whether the wakeup of end i is signaled
+		int wakeups[2][2]; //!< wakeup objects of each end, see createWakeup()
+
+		//! Constructor, creates the wakeup objects
+		MemoryConnection()
+		{
+			for (int i = 0; i < 2; ++i)
+			{
+				closed[i].store(false);
+				wakeupPending[i].store(false);
+			}
+			createWakeup(wakeups[0]);
+			try
+			{
+				createWakeup(wakeups[1]);
+			}
+			catch (...)
+			{
+				closeWakeup(wakeups[0]);
+				throw;
+			}
+		}
+
+		//! Destructor, closes the wakeup objects once both ends are destroyed
+		~MemoryConnection()
+		{
+			closeWakeup(wakeups[0]);
+			closeWakeup(wakeups[1]);
+		}
+
+		//! Wake end i up, unless it is already
+		void wake(int i)
+		{
+			if (!wakeupPending[i].exchange(true, std::memory_order_acq_rel))
+				signalWakeup(wakeups[i][1]);
+		}
+	};
+
+	class MemoryServerStream;
+
+	//! Lock protecting the registry of memory listeners and their pending connections
+	static pthread_mutex_t memoryListenersLock = PTHREAD_MUTEX_INITIALIZER;
+
+	//! Return the registry of memory listeners by name, must be called with memoryListenersLock held
+	static std::map<std::string, MemoryServerStream*>& memoryListeners()
+	{
+		static std::map<std::string, MemoryServerStream*> listeners;
+		return listeners;
+	}
+
+	//! Listen for in-process connections to a name
+	class MemoryServerStream : public SelectableStream
+	{
+	protected:
+		friend class MemoryStream;
+		int wakeup[2]; //!< wakeup object signaled when connections are pending
+		std::map<unsigned, std::shared_ptr<MemoryConnection> > pending; //!< connections not yet accepted, by id, protected by memoryListenersLock
+		unsigned nextId; //!< id of the next pending connection, protected by memoryListenersLock
+
+	public:
+		//! Register the listener
+		explicit MemoryServerStream(const std::string& targetName) :
+			Stream("memin"),
+			SelectableStream("memin"),
+			nextId(0)
+		{
+			kind = MemoryListener;
+			target.add("memin:name");
+			target.add(targetName.c_str());
+
+			createWakeup(wakeup);
+			fd = wakeup[0];
+
+			pthread_mutex_lock(&memoryListenersLock);
+			const bool inserted(memoryListeners().insert(std::make_pair(target.get("name"), this)).second);
+			pthread_mutex_unlock(&memoryListenersLock);
+			if (!inserted)
+			{
+				closeWakeup(wakeup);
+				fd = -1;
+				throw DashelException(DashelException::ConnectionFailed, 0, "Memory listener name already in use.");
+			}
+		}
+
+		//! Unregister the listener, the pending connections are closed
+		virtual ~MemoryServerStream()
+		{
+			pthread_mutex_lock(&memoryListenersLock);
+			memoryListeners().erase(target.get("name"));
+			for (std::map<unsigned, std::shared_ptr<MemoryConnection> >::iterator it = pending.begin(); it != pending.end(); ++it)
+			{
+				it->second->closed[1].store(true, std::memory_order_release);
+				it->second->wake(0);
+			}
+			pthread_mutex_unlock(&memoryListenersLock);
+			closeWakeup(wakeup);
+			fd = -1;
+		}
+
+		//! Queue a new connection and wake the listener, must be called with memoryListenersLock held
+		void queue(const std::shared_ptr<MemoryConnection>& connection)
+		{
+			pending[nextId++] = connection;
+			signalWakeup(wakeup[1]);
+		}
+
+		//! Return the ids of pending connections, to be passed in the connection parameter of mem targets
+		std::vector<unsigned> pendingIds()
+		{
+			clearWakeup(fd);
+			std::vector<unsigned> ids;
+			pthread_mutex_lock(&memoryListenersLock);
+			for (std::map<unsigned, std::shared_ptr<MemoryConnection> >::const_iterator it = pending.begin(); it != pending.end(); ++it)
+				ids.push_back(it->first);
+			pthread_mutex_unlock(&memoryListenersLock);
+			return ids;
+		}
+
+		// clang-format off
+		virtual void write(const void* data, const size_t size) { /* hook for use by derived classes */ }
+		virtual void flush() { /* hook for use by derived classes */ }
+		virtual void read(void* data, size_t size) { /* hook for use by derived classes */ }
+		virtual bool receiveDataAndCheckDisconnection() { return false; }
+		virtual bool isDataInRecvBuffer() const { return false; }
+		// clang-format on
+	};
+
+	//! One end of an in-process connection to a memory listener
+	class MemoryStream : public DisconnectableStream
+	{
+	protected:
+		// clang-format off
+		//! Memory stream constants
+		enum Consts
+		{
+			UNSIGNALED_SIZE_LIMIT = 65536 //!< when that much data was written without flush, the peer is woken up
+		};
+		// clang-format on
+
+		std::shared_ptr<MemoryConnection> connection; //!< state shared with the other end
+		int side; //!< index of this end in connection, 0 for the connecting end, 1 for the accepted end
+		size_t unsignaledSize; //!< amount of data written since the peer was last woken up
+
+	public:
+		//! Connect to a listener, or accept a pending connection if the connection parameter is given
+		explicit MemoryStream(const std::string& targetName) :
+			Stream("mem"),
+			DisconnectableStream("mem"),
+			side(0),
+			unsignaledSize(0)
+		{
+			target.add("mem:name;connection=-1");
+			target.add(targetName.c_str());
+
+			const int id(target.get<int>("connection"));
+			pthread_mutex_lock(&memoryListenersLock);
+			std::map<std::string, MemoryServerStream*>::const_iterator it(memoryListeners().find(target.get("name")));
+			if (it == memoryListeners().end())
+			{
+				pthread_mutex_unlock(&memoryListenersLock);
+				throw DashelException(DashelException::ConnectionFailed, 0, "No memory listener with this name.");
+			}
+			if (id < 0)
+			{
+				try
+				{
+					connection.reset(new MemoryConnection);
+				}
+				catch (...)
+				{
+					pthread_mutex_unlock(&memoryListenersLock);
+					throw;
+				}
+				it->second->queue(connection);
+			}
+			else
+			{
+				std::map<unsigned, std::shared_ptr<MemoryConnection> >::iterator pendingIt(it->second->pending.find(id));
+				if (pendingIt != it->second->pending.end())
+				{
+					connection = pendingIt->second;
+					it->second->pending.erase(pendingIt);
+				}
+				side = 1;
+			}
+			pthread_mutex_unlock(&memoryListenersLock);
+			if (!connection)
+				throw DashelException(DashelException::ConnectionFailed, 0, "No pending memory connection with this id.");
+
+			// remove connection information from target name
+			target.erase("connection");
+
+			fd = connection->wakeups[side][0];
+		}
+
+		//! Close this end and wake the other one up
+		virtual ~MemoryStream()
+		{
+			connection->closed[side].store(true, std::memory_order_release);
+			connection->wake(1 - side);
+			// the file descriptor belongs to the connection
+			fd = -1;
+		}
+
+		virtual void write(const void* data, const size_t size)
+		{
+			if (size == 0)
+				return;
+
+			if (connection->closed[1 - side].load(std::memory_order_acquire))
+			{
+				fail(DashelException::ConnectionLost, 0, "Connection lost.");
+				return;
+			}
+
+			DASHEL_STAT(++statistics.writeCalls; statistics.bytesOut += size);
+			connection->queues[1 - side].push(data, size);
+			unsignaledSize += size;
+			if (unsignaledSize >= UNSIGNALED_SIZE_LIMIT)
+				flush();
+		}
+
+		virtual void flush()
+		{
+			unsignaledSize = 0;
+			connection->wake(1 - side);
+		}
+
+		virtual void read(void* data, size_t size)
+		{
+			if (size == 0)
+				return;
+
+			DASHEL_STAT(++statistics.readCalls; statistics.bytesIn += size);
+
+			unsigned char* ptr = (unsigned char*)data;
+			size_t left = size;
+			if (isDataInRecvBuffer())
+			{
+				const size_t toCopy(std::min(recvBufferSize - recvBufferPos, size));
+				memcpy(ptr, recvBuffer + recvBufferPos, toCopy);
+				recvBufferPos += toCopy;
+				ptr += toCopy;
+				left -= toCopy;
+			}
+
+			while (left)
+			{
+				const size_t len(connection->queues[side].pop(ptr, left));
+				ptr += len;
+				left -= len;
+				if (left == 0)
+					break;
+				if (connection->closed[1 - side].load(std::memory_order_acquire) && connection->queues[side].empty())
+				{
+					fail(DashelException::ConnectionLost, 0, "Connection lost.");
+					return;
+				}
+
+				// wait for the other end to write more data
+				connection->wakeupPending[side].store(false, std::memory_order_release);
+				if (connection->queues[side].empty() && !connection->closed[1 - side].load(std::memory_order_acquire))
+				{
+					struct pollfd pollFd;
+					pollFd.fd = fd;
+					pollFd.events = POLLIN;
+					pollFd.revents = 0;
+					pollFileDescriptors(&pollFd, 1, -1);
+				}
+				clearWakeup(fd);
+			}
+		}
+
+		virtual size_t readSome(void* data, size_t size)
+		{
+			if (size == 0)
+				return 0;
+
+			unsigned char* ptr = (unsigned char*)data;
+			size_t left = size;
+			if (isDataInRecvBuffer())
+			{
+				const size_t toCopy(std::min(recvBufferSize - recvBufferPos, size));
+				memcpy(ptr, recvBuffer + recvBufferPos, toCopy);
+				recvBufferPos += toCopy;
+				ptr += toCopy;
+				left -= toCopy;
+			}
+			left -= connection->queues[side].pop(ptr, left);
+			if (left == size && connection->closed[1 - side].load(std::memory_order_acquire) && connection->queues[side].empty())
+				fail(DashelException::ConnectionLost, 0, "Connection lost.");
+
+			DASHEL_STAT(++statistics.readCalls; statistics.bytesIn += size - left);
+			return size - left;
+		}
+
+		virtual bool receiveDataAndCheckDisconnection()
+		{
+			assert(recvBufferPos == recvBufferSize);
+
+			// clear the wakeup before looking at the queue, so that no data written afterwards is missed
+			clearWakeup(fd);
+			connection->wakeupPending[side].store(false, std::memory_order_seq_cst);
+
+			acquireRecvBuffer();
+			recvBufferSize = connection->queues[side].pop(recvBuffer, RECV_BUFFER_SIZE);
+			recvBufferPos = 0;
+			if (recvBufferSize == 0)
+				return connection->closed[1 - side].load(std::memory_order_acquire) && connection->queues[side].empty();
+
+			// come back for the rest of the data
+			if (!connection->queues[side].empty())
+				connection->wake(side);
+			return false;
+		}
+	};
+
+
+	// Hub
+
+	//! Arrays used by Hub::step(), kept between calls so that their memory is reused
+	struct StepBuffers
+	{
+		std::vector<struct pollfd> pollFds; //!< file descriptors to poll, those of streams followed by the termination pipe and the wakeup
+		std::vector<SelectableStream*> streams; //!< streams, in the order of pollFds
+		std::vector<Stream*> failedStreams; //!< streams that failed during the step
+		std::vector<std::pair<SelectableStream*, unsigned long long> > finishedTasks; //!< streams whose data were delivered by worker threads
+	};
+
+	//! Threads delivering the data received by streams to the handlers of the Hub, see Hub::setWorkerThreads()
+	class WorkerPool
+	{
+	protected:
+		std::deque<SelectableStream*> tasks; //!< streams whose received data must be delivered, in the order they were dispatched
+		std::vector<std::pair<SelectableStream*, unsigned long long> > finished; //!< delivered streams, with the time spent in handlers
+		std::vector<pthread_t> threads; //!< worker threads
+		std::exception_ptr handlerException; //!< first exception other than DashelException thrown by a handler, rethrown by step()
+		pthread_mutex_t mutex; //!< protects tasks, finished, handlerException and stopping
+		pthread_cond_t taskAvailable; //!< signaled when a task is dispatched or when stopping
+		bool stopping; //!< whether the worker threads must deliver the remaining tasks and stop
+
+	public:
+		//! Create a pool without threads
+		WorkerPool() :
+			stopping(false)
+		{
+			pthread_mutex_init(&mutex, NULL);
+			pthread_cond_init(&taskAvailable, NULL);
+		}
+
+		//! Stop the threads if they are still running
+		~WorkerPool()
+		{
+			stop();
+			pthread_cond_destroy(&taskAvailable);
+			pthread_mutex_destroy(&mutex);
+		}
+
+		//! Start count threads running entry(argument)
+		void start(unsigned count, void* (*entry)(void*), void* argument)
+		{
+			threads.reserve(count);
+			for (unsigned i = 0; i < count; ++i)
+			{
+				pthread_t thread;
+				const int ret(pthread_create(&thread, NULL, entry, argument));
+				if (ret != 0)
+					throw DashelException(DashelException::SyncError, ret, "Cannot start worker thread.");
+				threads.push_back(thread);
+			}
+		}
+
+		//! Let the threads deliver the remaining tasks, and wait for them to stop
+		void stop()
+		{
+			pthread_mutex_lock(&mutex);
+			stopping = true;
+			pthread_cond_broadcast(&taskAvailable);
+			pthread_mutex_unlock(&mutex);
+			for (size_t i = 0; i < threads.size(); ++i)
+				pthread_join(threads[i], NULL);
+			threads.clear();
+		}
+
+		//! Hand a stream over to the worker threads
+		void dispatch(SelectableStream* stream)
+		{
+			pthread_mutex_lock(&mutex);
+			tasks.push_back(stream);
+			pthread_cond_signal(&taskAvailable);
+			pthread_mutex_unlock(&mutex);
+		}
+
+		//! Wait for a stream to deliver, return false if the pool is stopping and no task remains
+		bool takeTask(SelectableStream*& stream)
+		{
+			pthread_mutex_lock(&mutex);
+			while (tasks.empty() && !stopping)
+				pthread_cond_wait(&taskAvailable, &mutex);
+			const bool available(!tasks.empty());
+			if (available)
+			{
+				stream = tasks.front();
+				tasks.pop_front();
+			}
+			pthread_mutex_unlock(&mutex);
+			return available;
+		}
+
+		//! Record that the data of a stream were delivered, handlerTime being the time spent in handlers
+		void finish(SelectableStream* stream, unsigned long long handlerTime)
+		{
+			pthread_mutex_lock(&mutex);
+			finished.push_back(std::make_pair(stream, handlerTime));
+			pthread_mutex_unlock(&mutex);
+		}
+
+		//! Keep an exception thrown by a handler for step() to rethrow, unless one is already kept
+		void keepException(const std::exception_ptr& exception)
+		{
+			pthread_mutex_lock(&mutex);
+			if (!handlerException)
+				handlerException = exception;
+			pthread_mutex_unlock(&mutex);
+		}
+
+		//! Return the exception kept by keepException() and forget it, or a null pointer
+		std::exception_ptr takeException()
+		{
+			pthread_mutex_lock(&mutex);
+			std::exception_ptr exception;
+			std::swap(exception, handlerException);
+			pthread_mutex_unlock(&mutex);
+			return exception;
+		}
+
+		//! Move the streams delivered since the last call to result, which is cleared first
+		void takeFinished(std::vector<std::pair<SelectableStream*, unsigned long long> >& result)
+		{
+			result.clear();
+			pthread_mutex_lock(&mutex);
+			finished.swap(result);
+			pthread_mutex_unlock(&mutex);
+		}
+	};
+
+
+
+	Hub::Hub(const bool resolveIncomingNames) :
+		spinDuration(0),
+		cpuAffinityPending(false),
+		slowHandlerThreshold(0),
+		resolveIncomingNames(resolveIncomingNames)
+	{
+		int* terminationPipes = new int[2];
+		if (pipe(terminationPipes) != 0)
+			abort();
+		hTerminate = terminationPipes;
+
+		int* wakeup = new int[2];
+		createWakeup(wakeup);
+		hWakeup = wakeup;
+
+		streamsLock = new pthread_mutex_t;
+
+		pthread_mutex_init((pthread_mutex_t*)streamsLock, NULL);
+
+		bufferPool = new BufferPool;
+		stepBuffers = new StepBuffers;
+		workerPool = 0;
+	}
+
+	Hub::~Hub()
+	{
+		// handlers still running must not use the streams, and streams closed while they were dispatched are deleted;
+		// this is done first, as worker threads signal the wakeup
+		if (workerPool)
+		{
+			((WorkerPool*)workerPool)->stop();
+			finishWorkerTasks();
+			delete (WorkerPool*)workerPool;
+		}
+
+		int* terminationPipes = (int*)hTerminate;
+		close(terminationPipes[0]);
+		close(terminationPipes[1]);
+		delete[] terminationPipes;
+
+		int* wakeup = (int*)hWakeup;
+		closeWakeup(wakeup);
+		delete[] wakeup;
+
+		for (StreamsSet::iterator it = streams.begin(); it != streams.end(); ++it)
+			delete *it;
+
+		delete (BufferPool*)bufferPool;
+		delete (StepBuffers*)stepBuffers;
+
+		pthread_mutex_destroy((pthread_mutex_t*)streamsLock);
+
+		delete (pthread_mutex_t*)streamsLock;
+	}
+
+	Stream* Hub::connect(const std::string& target)
+	{
+		std::string proto;
+		size_t c = target.find_first_of(':');
+		if (c == std::string::npos)
+			throw DashelException(DashelException::InvalidTarget, 0, "No protocol specified in target.");
+		proto = target.substr(0, c);
+		// N.B. params = target.substr(c+1)
+
+		Stream* s(streamTypeRegistry.create(proto, target, *this));
+		if (!s)
+		{
+			std::string r = "Invalid protocol in target: ";
+			r += proto;
+			r += ", known protocol are: ";
+			r += streamTypeRegistry.list();
+			throw DashelException(DashelException::InvalidTarget, 0, r.c_str());
+		}
+
+		const bool isListening(proto == "tcpin" || proto == "metricsin" || proto == "memin");
+		return addStream(s, isListening);
+	}
+
+	Stream* Hub::addStream(Stream* stream, bool isListening)
+	{
+		SelectableStream* s(polymorphic_downcast<SelectableStream*>(stream));
+		s->setBufferPool((BufferPool*)bufferPool);
+		if (!isListening)
+		{
+			try
+			{
+				// streams with a deferred target create their framer themselves
+				if (!s->framer)
+					s->framer = MessageFramer::create(s->target);
+			}
+			catch (...)
+			{
+				delete s;
+				throw;
+			}
+			if (s->framer && !s->supportsFraming())
+			{
+				delete s;
+				throw DashelException(DashelException::InvalidTarget, 0, "Message framing is not supported on this stream type.");
+			}
+		}
+
+		/* The caller must have the stream lock held */
+
+		streams.insert(s);
+		if (!isListening)
+		{
+			dataStreams.insert(s);
+			DASHEL_STAT(++statistics.connectionsCreated);
+			DASHEL_PROBE2(connection__created, this, s);
+			connectionCreated(s);
+		}
+
+		return s;
+	}
+
+	void Hub::run()
+	{
+		while (step(-1))
+			;
+	}
+
+	void Hub::applyCpuAffinity()
+	{
+		cpuAffinityPending = false;
+#ifdef __linux__
+		cpu_set_t cpuSet;
+		CPU_ZERO(&cpuSet);
+		for (size_t i = 0; i < cpuAffinity.size(); ++i)
+		{
+			if (cpuAffinity[i] >= CPU_SETSIZE)
+				throw DashelException(DashelException::InvalidOperation, 0, "CPU index out of range.");
+			CPU_SET(cpuAffinity[i], &cpuSet);
+		}
+		const int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+		if (ret != 0)
+			throw DashelException(DashelException::InvalidOperation, ret, "Cannot set CPU affinity of Hub thread.");
+#else
+		throw DashelException(DashelException::InvalidOperation, 0, "CPU affinity is not supported on this platform.");
+#endif
+	}
+
+	bool Hub::step(const int timeout)
+	{
+		if (cpuAffinityPending)
+			applyCpuAffinity();
+
+		bool firstPoll = true;
 		bool wasActivity = false;
 		bool runInterrupted = false;
 
+		DASHEL_STAT(++statistics.steps);
+
 		pthread_mutex_lock((pthread_mutex_t*)streamsLock);
 
 		do
 		{
 			wasActivity = false;
 			size_t streamsCount = streams.size();
-			valarray<struct pollfd> pollFdsArray(streamsCount + 1);
-			valarray<SelectableStream*> streamsArray(streamsCount);
+			std::vector<struct pollfd>& pollFdsArray(((StepBuffers*)stepBuffers)->pollFds);
+			std::vector<SelectableStream*>& streamsArray(((StepBuffers*)stepBuffers)->streams);
+			pollFdsArray.resize(streamsCount + 2);
+			streamsArray.resize(streamsCount);
 
 			// add streams
 			size_t i = 0;
+			unsigned long long earliestDeadline = 0;
 			for (StreamsSet::iterator it = streams.begin(); it != streams.end(); ++it)
 			{
-				SelectableStream* stream = polymorphic_downcast<SelectableStream*>(*it);
+				SelectableStream* stream = static_cast<SelectableStream*>((*it)->platformStream);
+				assert(stream == dynamic_cast<SelectableStream*>(*it));
 
 				streamsArray[i] = stream;
-				pollFdsArray[i].fd = stream->fd;
+				// poll ignores negative descriptors, so paused streams and streams served by worker threads do not report any event
+				const bool polled(!stream->dispatched && !stream->readingPaused);
+				pollFdsArray[i].fd = polled ? stream->fd : -1;
 				pollFdsArray[i].events = 0;
-				if ((!stream->failed()) && (!stream->writeOnly))
+				if (polled && (!stream->failed()) && (!stream->writeOnly))
 					pollFdsArray[i].events |= stream->pollEvent;
 
+				const unsigned long long deadline(polled ? stream->nextDeadline() : 0);
+				if (deadline && (!earliestDeadline || deadline < earliestDeadline))
+					earliestDeadline = deadline;
+
 				i++;
 			}
 			// add pipe
 			int* terminationPipes = (int*)hTerminate;
 			pollFdsArray[i].fd = terminationPipes[0];
 			pollFdsArray[i].events = POLLIN;
+			// add wakeup, signaled when reading resumes
+			int* wakeup = (int*)hWakeup;
+			pollFdsArray[i + 1].fd = wakeup[0];
+			pollFdsArray[i + 1].events = POLLIN;
 
 			// do poll and check for error
 			int thisPollTimeout = firstPoll ? timeout : 0;
 			firstPoll = false;
 
+			// wake up in time to serve the stream with the earliest deadline
+			if (earliestDeadline && thisPollTimeout != 0)
+			{
+				const unsigned long long now(monotonicNanoseconds());
+				const unsigned long long deadlineTimeout(earliestDeadline > now ? (earliestDeadline - now + 999999) / 1000000 : 0);
+				if (thisPollTimeout < 0 || deadlineTimeout < (unsigned long long)thisPollTimeout)
+					thisPollTimeout = int(deadlineTimeout);
+			}
+
 			pthread_mutex_unlock((pthread_mutex_t*)streamsLock);
 
-#ifndef USE_POLL_EMU
-			int ret = poll(&pollFdsArray[0], pollFdsArray.size(), thisPollTimeout);
-#else
-			int ret = poll_emu(&pollFdsArray[0], pollFdsArray.size(), thisPollTimeout);
-#endif
+			DASHEL_PROBE3(poll__enter, this, pollFdsArray.size(), thisPollTimeout);
+			int ret;
+			if (thisPollTimeout != 0 && spinDuration != 0)
+			{
+				// check for activity without blocking during the spin duration, then wait for the rest of the timeout
+				const unsigned long long spinStart(monotonicNanoseconds());
+				unsigned long long elapsed;
+				do
+				{
+					ret = pollFileDescriptors(&pollFdsArray[0], pollFdsArray.size(), 0);
+					elapsed = monotonicNanoseconds() - spinStart;
+				} while (ret == 0 && elapsed < spinDuration * 1000ULL && (thisPollTimeout < 0 || elapsed < thisPollTimeout * 1000000ULL));
+
+				if (ret == 0)
+				{
+					const int elapsedMs(elapsed / 1000000);
+					if (thisPollTimeout < 0)
+						ret = pollFileDescriptors(&pollFdsArray[0], pollFdsArray.size(), -1);
+					else if (elapsedMs < thisPollTimeout)
+						ret = pollFileDescriptors(&pollFdsArray[0], pollFdsArray.size(), thisPollTimeout - elapsedMs);
+				}
+			}
+			else
+				ret = pollFileDescriptors(&pollFdsArray[0], pollFdsArray.size(), thisPollTimeout);
+			DASHEL_PROBE2(poll__exit, this, ret);
 			if (ret < 0)
 				throw DashelException(DashelException::SyncError, errno, "Error during poll.");
+			DASHEL_STAT(++statistics.polls; if (ret > 0) ++statistics.pollWakeups);
 
 			pthread_mutex_lock((pthread_mutex_t*)streamsLock);
+#ifndef DASHEL_NO_STATS
+			// streams are served if poll reported activity or if their deadline passed
+			const unsigned long long pollReturn(ret > 0 || earliestDeadline ? monotonicNanoseconds() : 0);
+#endif
+			const unsigned long long deadlineNow(earliestDeadline ? monotonicNanoseconds() : 0);
+
+			// consume the wakeup before looking for what it signals, so that no later signal is lost
+			if (pollFdsArray[streamsCount + 1].revents)
+				clearWakeup(pollFdsArray[streamsCount + 1].fd);
+
+			// streams served by worker threads since the last poll are polled again
+			if (workerPool && finishWorkerTasks())
+			{
+				wasActivity = true;
+				// exceptions of handlers propagate out of step(), as when handlers run in step()
+				const std::exception_ptr handlerException(((WorkerPool*)workerPool)->takeException());
+				if (handlerException)
+				{
+					pthread_mutex_unlock((pthread_mutex_t*)streamsLock);
+					std::rethrow_exception(handlerException);
+				}
+			}
 
 			// check streams for errors
 			for (i = 0; i < streamsCount; i++)
 			{
 				SelectableStream* stream = streamsArray[i];
 
-				// make sure we do not try to handle removed streams
-				if (streams.find(stream) == streams.end())
+				// make sure we do not try to handle removed streams, nor streams paused or dispatched since the poll
+				if (streams.find(stream) == streams.end() || stream->dispatched || stream->readingPaused)
 					continue;
 
 				assert((pollFdsArray[i].revents & POLLNVAL) == 0);
 
-				if (pollFdsArray[i].revents & POLLERR)
+				// streams resumed with data left in their reception buffer are served without waiting for new data
+				if (stream->deliveryPending)
+					pollFdsArray[i].revents |= stream->pollEvent;
+
+				// streams whose deadline has passed are served as if data were available
+				if (earliestDeadline)
+				{
+					const unsigned long long deadline(stream->nextDeadline());
+					if (deadline && deadline <= deadlineNow)
+						pollFdsArray[i].revents |= stream->pollEvent;
+				}
+
+				if (stream->internal && (pollFdsArray[i].revents & (POLLERR | POLLHUP)))
+				{
+					wasActivity = true;
+					closeStream(stream);
+				}
+				else if (pollFdsArray[i].revents & POLLERR)
 				{
 					wasActivity = true;
 
-					try
-					{
-						stream->fail(DashelException::SyncError, 0, "Error on stream during poll.");
-					}
-					catch (const DashelException& e)
-					{
-						assert(e.stream);
-					}
+					stream->throwOnFailure = false;
+					stream->fail(DashelException::SyncError, 0, "Error on stream during poll.");
+					stream->throwOnFailure = true;
 
 					try
 					{
+						DASHEL_PROBE3(connection__closed, this, stream, true);
 						connectionClosed(stream, true);
 					}
 					catch (const DashelException& e)
@@ -1288,6 +3893,7 @@ namespace Dashel
 
 					try
 					{
+						DASHEL_PROBE3(connection__closed, this, stream, false);
 						connectionClosed(stream, false);
 					}
 					catch (const DashelException& e)
@@ -1301,54 +3907,111 @@ namespace Dashel
 				{
 					wasActivity = true;
 
-					// test if listen stream
-					SocketServerStream* serverStream = dynamic_cast<SocketServerStream*>(stream);
-
-					if (serverStream)
+					if (stream->kind == SelectableStream::MemoryListener)
+					{
+						MemoryServerStream* memoryServerStream = static_cast<MemoryServerStream*>(stream);
+						// accept pending in-process connections
+						const std::vector<unsigned> ids(memoryServerStream->pendingIds());
+						for (size_t j = 0; j < ids.size(); ++j)
+						{
+							ostringstream targetName;
+							targetName << "mem:name=" << memoryServerStream->getTargetParameter("name");
+							targetName << ";connection=" << ids[j];
+							for (size_t k = 0; k < sizeof(inheritedParameters) / sizeof(const char*); ++k)
+								if (memoryServerStream->target.isSet(inheritedParameters[k]))
+									targetName << ";" << inheritedParameters[k] << "=" << memoryServerStream->target.get(inheritedParameters[k]);
+							connect(targetName.str());
+						}
+					}
+					else if (stream->kind == SelectableStream::SocketListener)
 					{
+						SocketServerStream* serverStream = static_cast<SocketServerStream*>(stream);
+
 						// accept connection
 						struct sockaddr_in targetAddr;
 						socklen_t l = sizeof(targetAddr);
 						int targetFD = accept(stream->fd, (struct sockaddr*)&targetAddr, &l);
+						DASHEL_PROBE3(accept, this, stream, targetFD);
 						if (targetFD < 0)
 						{
 							pthread_mutex_unlock((pthread_mutex_t*)streamsLock);
 							throw DashelException(DashelException::SyncError, errno, "Cannot accept new stream.");
 						}
 
-						// create a target stream using the new file descriptor from accept
-						ostringstream targetName;
-						targetName << IPV4Address(ntohl(targetAddr.sin_addr.s_addr), ntohs(targetAddr.sin_port)).format(resolveIncomingNames);
-						targetName << ";connectionPort=";
-						targetName << atoi(serverStream->getTargetParameter("port").c_str());
-						targetName << ";sock=";
-						targetName << targetFD;
-						connect(targetName.str());
+						// connections served by the library are not passed to the subclass
+						SelectableStream* internalStream(serverStream->createInternalConnection(targetFD));
+						if (internalStream)
+						{
+							streams.insert(internalStream);
+							continue;
+						}
+
+						// create a stream using the new file descriptor from accept
+						const IPV4Address remoteAddress(ntohl(targetAddr.sin_addr.s_addr), ntohs(targetAddr.sin_port));
+						addStream(serverStream->createConnection(targetFD, remoteAddress, resolveIncomingNames), false);
+					}
+					else if (stream->internal)
+					{
+						if (stream->serveInternally())
+							closeStream(stream);
 					}
 					else
 					{
+#ifndef DASHEL_NO_STATS
+						const unsigned long long handlerStart(monotonicNanoseconds());
+						latencyHistograms.dispatchDelay.record(handlerStart - pollReturn);
+#endif
 						bool streamClosed = false;
+						// a resumed stream first delivers the data it received before being paused
+						const bool resumed(stream->deliveryPending);
+						stream->deliveryPending = false;
 						try
 						{
-							if (stream->receiveDataAndCheckDisconnection())
+							// receive errors do not throw, the stream is closed with the other failed streams below
+							stream->throwOnFailure = false;
+							const bool disconnected(resumed ? false : stream->receiveDataAndCheckDisconnection());
+							stream->throwOnFailure = true;
+							if (stream->failed())
+							{
+								// closed below
+							}
+							else if (disconnected)
 							{
+								DASHEL_PROBE3(connection__closed, this, stream, false);
 								connectionClosed(stream, false);
 								streamClosed = true;
 							}
 							else
 							{
-								// read all data available on this socket
-								while (stream->isDataInRecvBuffer())
-									incomingData(stream);
+								if (stream->framer && !resumed)
+								{
+									size_t size;
+									const unsigned char* data = stream->takeRecvBuffer(size);
+									stream->framer->push(data, size);
+								}
+								if (workerPool)
+								{
+									// the stream is not polled until a worker thread has delivered its data
+									stream->dispatched = true;
+									((WorkerPool*)workerPool)->dispatch(stream);
+									continue;
+								}
+								deliverReceivedData(stream);
 							}
 						}
 						catch (const DashelException& e)
 						{
 							assert(e.stream);
+							stream->throwOnFailure = true;
 						}
+#ifndef DASHEL_NO_STATS
+						recordHandlerTime(stream, monotonicNanoseconds() - handlerStart);
+#endif
 
 						if (streamClosed)
 							closeStream(stream);
+						else if (!stream->framer || !stream->framer->hasUnprocessedData())
+							stream->releaseRecvBuffer(); // the framer may still point to the received data if the stream was paused
 					}
 				}
 			}
@@ -1363,9 +4026,10 @@ namespace Dashel
 			}
 
 			// collect and remove all failed streams
-			vector<Stream*> failedStreams;
+			std::vector<Stream*>& failedStreams(((StepBuffers*)stepBuffers)->failedStreams);
+			failedStreams.clear();
 			for (StreamsSet::iterator it = streams.begin(); it != streams.end(); ++it)
-				if ((*it)->failed())
+				if (!static_cast<SelectableStream*>((*it)->platformStream)->dispatched && (*it)->failed())
 					failedStreams.push_back(*it);
 
 			for (size_t i = 0; i < failedStreams.size(); i++)
@@ -1377,6 +4041,7 @@ namespace Dashel
 				{
 					try
 					{
+						DASHEL_PROBE3(connection__closed, this, stream, true);
 						connectionClosed(stream, true);
 					}
 					catch (const DashelException& e)
@@ -1386,6 +4051,10 @@ namespace Dashel
 					closeStream(stream);
 				}
 			}
+#ifndef DASHEL_NO_STATS
+			if (ret > 0)
+				latencyHistograms.iteration.record(monotonicNanoseconds() - pollReturn);
+#endif
 		} while (wasActivity && !runInterrupted);
 
 		pthread_mutex_unlock((pthread_mutex_t*)streamsLock);
@@ -1393,6 +4062,147 @@ namespace Dashel
 		return !runInterrupted;
 	}
 
+	void Hub::deliverReceivedData(Stream* stream)
+	{
+		SelectableStream* selectableStream = static_cast<SelectableStream*>(stream->platformStream);
+		if (selectableStream->framer)
+		{
+			// deliver all complete messages in the received data
+			const unsigned char* message;
+			size_t size;
+			while (!selectableStream->readingPaused && selectableStream->framer->next(stream, message, size))
+			{
+				DASHEL_PROBE3(incoming__message, this, stream, size);
+				incomingMessage(stream, message, size);
+			}
+		}
+		else
+		{
+			// read all data available on this socket
+			// check for pausing first, as isDataInRecvBuffer() may consume the readiness of the stream
+			while (!selectableStream->readingPaused && selectableStream->isDataInRecvBuffer())
+			{
+				DASHEL_PROBE2(incoming__data, this, stream);
+				incomingData(stream);
+			}
+		}
+	}
+
+	bool Hub::finishWorkerTasks()
+	{
+		std::vector<std::pair<SelectableStream*, unsigned long long> >& finishedTasks(((StepBuffers*)stepBuffers)->finishedTasks);
+		((WorkerPool*)workerPool)->takeFinished(finishedTasks);
+		for (size_t i = 0; i < finishedTasks.size(); ++i)
+		{
+			SelectableStream* stream = finishedTasks[i].first;
+			stream->dispatched = false;
+			// streams closed while dispatched were removed from the Hub, but not deleted
+			if (streams.find(stream) == streams.end())
+			{
+				delete stream;
+				continue;
+			}
+#ifndef DASHEL_NO_STATS
+			recordHandlerTime(stream, finishedTasks[i].second);
+#endif
+			if (!stream->framer || !stream->framer->hasUnprocessedData())
+				stream->releaseRecvBuffer();
+		}
+		return !finishedTasks.empty();
+	}
+
+	void* Hub::runWorker(void* hubPointer)
+	{
+		Hub* hub = static_cast<Hub*>(hubPointer);
+		WorkerPool* pool = (WorkerPool*)hub->workerPool;
+		SelectableStream* stream;
+		while (pool->takeTask(stream))
+		{
+			const unsigned long long handlerStart(monotonicNanoseconds());
+			try
+			{
+				hub->deliverReceivedData(stream);
+			}
+			catch (const DashelException& e)
+			{
+				// the stream failed, it is closed by step() once finished
+				assert(e.stream);
+				stream->throwOnFailure = true;
+			}
+			catch (...)
+			{
+				pool->keepException(std::current_exception());
+			}
+			pool->finish(stream, monotonicNanoseconds() - handlerStart);
+			signalWakeup(((int*)hub->hWakeup)[1]);
+		}
+		return 0;
+	}
+
+	void Hub::setWorkerThreads(unsigned count)
+	{
+		std::exception_ptr handlerException;
+		if (workerPool)
+		{
+			// wait for the dispatched streams to be delivered
+			((WorkerPool*)workerPool)->stop();
+			finishWorkerTasks();
+			handlerException = ((WorkerPool*)workerPool)->takeException();
+			delete (WorkerPool*)workerPool;
+			workerPool = 0;
+			((BufferPool*)bufferPool)->setThreadSafe(false);
+		}
+		if (count)
+		{
+			// streams served by worker threads use the pool without the lock of the Hub
+			((BufferPool*)bufferPool)->setThreadSafe(true);
+			// the threads find the pool through the Hub
+			workerPool = new WorkerPool;
+			try
+			{
+				((WorkerPool*)workerPool)->start(count, &runWorker, this);
+			}
+			catch (const DashelException& e)
+			{
+				delete (WorkerPool*)workerPool;
+				workerPool = 0;
+				((BufferPool*)bufferPool)->setThreadSafe(false);
+				throw;
+			}
+		}
+		if (handlerException)
+			std::rethrow_exception(handlerException);
+	}
+
+	void Hub::closeStream(Stream* stream)
+	{
+		streams.erase(stream);
+		if (dataStreams.erase(stream))
+			DASHEL_STAT(++statistics.connectionsClosed);
+		// a stream dispatched to a worker thread is deleted once its data were delivered, see finishWorkerTasks()
+		SelectableStream* selectableStream = static_cast<SelectableStream*>(stream->platformStream);
+		if (selectableStream && selectableStream->dispatched)
+			return;
+		delete stream;
+	}
+
+	void Hub::pauseReading(Stream* stream)
+	{
+		SelectableStream* selectableStream = static_cast<SelectableStream*>(stream->platformStream);
+		selectableStream->readingPaused = true;
+	}
+
+	void Hub::resumeReading(Stream* stream)
+	{
+		SelectableStream* selectableStream = static_cast<SelectableStream*>(stream->platformStream);
+		if (!selectableStream->readingPaused)
+			return;
+		selectableStream->readingPaused = false;
+		// data might have been left in the reception buffer or the framer when the stream was paused
+		selectableStream->deliveryPending = selectableStream->kind == SelectableStream::DataStream && !selectableStream->internal;
+		signalWakeup(((int*)hWakeup)[1]);
+	}
+
 	void Hub::lock()
 	{
 		pthread_mutex_lock((pthread_mutex_t*)streamsLock);
@@ -1422,6 +4232,12 @@ namespace Dashel
 		reg("tcp", &createInstance<SocketStream>);
 		reg("tcppoll", &createInstance<PollStream>);
 		reg("udp", &createInstance<UDPSocketStream>);
+		reg("metricsin", &createInstanceWithHub<MetricsServerStream>);
+		reg("record", &createInstanceWithHub<RecordStream>);
+		reg("replay", &createInstance<ReplayStream>);
+		reg("memin", &createInstance<MemoryServerStream>);
+		reg("mem", &createInstance<MemoryStream>);
+		reg("netsim", &createInstanceWithHub<NetSimStream>);
 	}
 
 	StreamTypeRegistry __attribute__((init_priority(1000))) streamTypeRegistry;
@@ -47,13 +47,32 @@
 
 namespace Dashel
 {
+	class MessageFramer;
+	class BufferPool;
+
 	//! Stream with a file descriptor that is selectable
 	class SelectableStream : virtual public Stream
 	{
 	protected:
+		// clang-format off
+		//! What the Hub does when the file descriptor of a stream is ready
+		typedef enum {
+			DataStream,		//!< receive data and pass them to the Hub subclass
+			SocketListener,	//!< accept an incoming connection, the stream is a SocketServerStream
+			MemoryListener	//!< accept the pending in-process connections, the stream is a MemoryServerStream
+		} Kind;
+		// clang-format on
+
 		int fd; //!< associated file descriptor
 		bool writeOnly; //!< true if we can only write on this stream
 		short pollEvent; //!< the poll event we must react to
+		MessageFramer* framer; //!< if not 0, reassemble messages out of received data
+		bool internal; //!< if true, the stream is served by the library and never passed to the Hub subclass
+		Kind kind; //!< how the Hub serves this stream, so that it does not need dynamic casts
+		BufferPool* bufferPool; //!< pool of the Hub to borrow reception buffers from, 0 if the stream is not in a Hub
+		bool readingPaused; //!< if true, the Hub does not poll this stream, see Hub::pauseReading()
+		bool deliveryPending; //!< if true, data received before the stream was paused must be delivered by the next step
+		bool dispatched; //!< if true, a worker thread of the Hub is delivering the received data, see Hub::setWorkerThreads()
 		friend class Hub;
 
 	public:
@@ -62,11 +81,53 @@ namespace Dashel
 
 		virtual ~SelectableStream();
 
+		//! Allocate a stream from the pool of a Hub, or from the heap if pool is 0
+		static void* operator new(size_t size, BufferPool* pool);
+		//! Allocate a stream from the heap
+		static void* operator new(size_t size) { return operator new(size, 0); }
+		//! Free a stream, giving its memory back to where it was allocated from
+		static void operator delete(void* ptr);
+		//! Free a stream whose constructor threw
+		static void operator delete(void* ptr, BufferPool* pool) { operator delete(ptr); }
+
 		//! If necessary, read a byte and check for disconnection; return true on disconnection, fales otherwise
 		virtual bool receiveDataAndCheckDisconnection() = 0;
 
 		//! Return true while there is some unread data in the reception buffer
 		virtual bool isDataInRecvBuffer() const = 0;
+
+		//! Return the unread data in the reception buffer and mark them as read, used for message framing
+		virtual const unsigned char* takeRecvBuffer(size_t& size)
+		{
+			size = 0;
+			return 0;
+		}
+
+		//! Handle activity on an internal stream, return true if the stream must be closed
+		virtual bool serveInternally() { return false; }
+
+		//! Return whether takeRecvBuffer() returns the received data, so that messages can be framed
+		virtual bool supportsFraming() const { return false; }
+
+		//! Set the pool to borrow reception buffers from, called when the stream is added to a Hub
+		virtual void setBufferPool(BufferPool* pool) { bufferPool = pool; }
+
+		// clang-format off
+		//! Give the reception buffer back to the pool if all its data were read, called by the Hub after serving the stream
+		virtual void releaseRecvBuffer() { /* hook for use by derived classes */ }
+		// clang-format on
+
+		//! Return the monotonic time in nanoseconds at which the Hub must serve this stream even without activity on its file descriptor, 0 if none
+		virtual unsigned long long nextDeadline() const { return 0; }
+
+	protected:
+		//! Poll the file descriptor of another stream, for streams wrapping it; the descriptor is not owned
+		void shareFileDescriptor(const SelectableStream& inner)
+		{
+			fd = inner.fd;
+			writeOnly = inner.writeOnly;
+			pollEvent = inner.pollEvent;
+		}
 	};
 }
 
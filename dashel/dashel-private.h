@@ -50,6 +50,37 @@
 #include <vector>
 #include <cassert>
 
+#ifdef DASHEL_NO_STATS
+#define DASHEL_STAT(statements) \
+	do \
+	{ \
+	} while (false)
+#else
+//! Update performance counters, compiled out when DASHEL_NO_STATS is defined
+#define DASHEL_STAT(statements) \
+	do \
+	{ \
+		statements; \
+	} while (false)
+#endif
+
+#ifdef DASHEL_USE_USDT
+#include <sys/sdt.h>
+//! Fire a static tracepoint of the dashel provider without argument
+#define DASHEL_PROBE0(name) DTRACE_PROBE(dashel, name)
+//! Fire a static tracepoint of the dashel provider with one argument
+#define DASHEL_PROBE1(name, a) DTRACE_PROBE1(dashel, name, a)
+//! Fire a static tracepoint of the dashel provider with two arguments
+#define DASHEL_PROBE2(name, a, b) DTRACE_PROBE2(dashel, name, a, b)
+//! Fire a static tracepoint of the dashel provider with three arguments
+#define DASHEL_PROBE3(name, a, b, c) DTRACE_PROBE3(dashel, name, a, b, c)
+#else
+#define DASHEL_PROBE0(name)
+#define DASHEL_PROBE1(name, a)
+#define DASHEL_PROBE2(name, a, b)
+#define DASHEL_PROBE3(name, a, b, c)
+#endif
+
 namespace Dashel
 {
 	//! A simple buffer that can expand when data is added (like std::vector), but that can also return a pointer to the underlying data (like std::valarray).
@@ -67,6 +98,8 @@ namespace Dashel
 		~ExpandableBuffer();
 		//! Remove all data from the buffer, the allocated memory is not freed to speed-up further reduce
 		void clear();
+		//! Remove all data from the buffer and free the allocated memory
+		void release();
 		//! Append data to the buffer
 		void add(const void* data, const size_t size);
 
@@ -78,20 +111,182 @@ namespace Dashel
 		size_t reservedSize() const { return _size; }
 	};
 
+	//! Source of the fixed-size segments of SegmentedBuffer
+	class SegmentAllocator
+	{
+	public:
+		//! Virtual destructor
+		virtual ~SegmentAllocator() {}
+		//! Allocate a segment of SegmentedBuffer::SEGMENT_SIZE bytes
+		virtual void* allocateSegment() = 0;
+		//! Give back a segment obtained from allocateSegment()
+		virtual void deallocateSegment(void* segment) = 0;
+	};
+
+	//! A buffer made of a chain of fixed-size segments, that can be sent with scatter/gather I/O
+	/*!
+		Appending never moves data already in the buffer, and clearing the buffer gives all its segments back,
+		so that the memory held is proportional to the data waiting, not to the largest burst ever written.
+		Segments come from a SegmentAllocator if one is set, from the heap otherwise.
+	*/
+	class SegmentedBuffer
+	{
+	public:
+		// clang-format off
+		//! Segment constants
+		enum Consts
+		{
+			SEGMENT_SIZE = 4096 //!< size of a segment, including its header
+		};
+		// clang-format on
+
+		//! A segment of the chain, its data follow the header
+		struct Segment
+		{
+			Segment* next; //!< next segment, 0 for the last one
+			size_t size; //!< amount of data stored in this segment
+
+			//! Return a pointer to the data of this segment
+			unsigned char* data() { return reinterpret_cast<unsigned char*>(this + 1); }
+			//! Return a pointer to the data of this segment
+			const unsigned char* data() const { return reinterpret_cast<const unsigned char*>(this + 1); }
+		};
+
+		//! Amount of data a segment can hold
+		static const size_t SEGMENT_CAPACITY = SEGMENT_SIZE - sizeof(Segment);
+
+	protected:
+		Segment* head; //!< first segment, 0 if the buffer is empty
+		Segment* tail; //!< last segment, the one data are appended to
+		size_t _size; //!< total amount of data stored
+		SegmentAllocator* allocator; //!< source of segments, 0 to use the heap
+
+	public:
+		//! Construct an empty buffer, holding no memory
+		SegmentedBuffer();
+		//! Destroy the buffer and give its segments back
+		~SegmentedBuffer();
+		//! Set the source of segments, the buffer must be empty
+		void setAllocator(SegmentAllocator* allocator);
+		//! Append data to the buffer
+		void add(const void* data, size_t size);
+		//! Remove all data from the buffer and give its segments back
+		void clear();
+
+		//! Return the first segment, 0 if the buffer is empty
+		const Segment* front() const { return head; }
+		//! Return the actual amount of data stored
+		size_t size() const { return _size; }
+		//! Return whether the buffer holds no data
+		bool empty() const { return _size == 0; }
+
+	private:
+		// buffers own their segments, they are not copyable
+		SegmentedBuffer(const SegmentedBuffer&);
+		SegmentedBuffer& operator=(const SegmentedBuffer&);
+	};
+
+	//! Reassembles complete messages out of a byte stream, following the framing parameters of its target
+	/*!
+		Data received on the stream are pushed with push(), then complete messages are extracted with next().
+		Messages lying entirely within the pushed data are returned in place, only partial messages are copied.
+	*/
+	class MessageFramer
+	{
+	public:
+		// clang-format off
+		//! The way the length of messages is encoded
+		typedef enum {
+			LengthU8,		//!< 8-bit length
+			LengthU16LE,	//!< 16-bit little-endian length
+			LengthU16BE,	//!< 16-bit big-endian length
+			LengthU32LE,	//!< 32-bit little-endian length
+			LengthU32BE,	//!< 32-bit big-endian length
+			LengthVarint,	//!< unsigned LEB128 variable-length integer
+			Delimited,		//!< messages end with a delimiter byte
+			Lines			//!< messages are lines of text, ending with \n or \r\n
+		} Mode;
+		// clang-format on
+
+	protected:
+		Mode mode; //!< encoding of the length field
+		size_t lengthSize; //!< size of the length field in bytes, 0 if it has no fixed size
+		size_t headerSize; //!< size of the header in bytes, including the length field
+		size_t lengthOffset; //!< position of the length field within the header
+		bool lengthInclusive; //!< whether the length field counts the header as well
+		size_t maxSize; //!< size of the largest frame accepted
+		unsigned char delimiter; //!< byte ending frames, for delimited modes
+		ExpandableBuffer pending; //!< beginning of a frame whose end has not been received yet
+		bool pendingDelivered; //!< whether pending holds a frame that was returned by next()
+		const unsigned char* chunk; //!< unprocessed part of the last pushed data
+		size_t chunkSize; //!< amount of unprocessed data in chunk
+
+	public:
+		//! Create a framer if target requests message framing, return 0 otherwise
+		static MessageFramer* create(const ParameterSet& target);
+
+		//! Provide newly received data, that must remain valid until next() returns false
+		void push(const unsigned char* data, size_t size);
+
+		//! Extract the next complete message, return false if more data are required
+		/*!
+			The returned message remains valid until the next call to next().
+			Fails the stream if the frame is invalid or too large.
+		*/
+		bool next(Stream* stream, const unsigned char*& message, size_t& size);
+
+		//! Return whether some pushed data have not been processed by next() yet
+		bool hasUnprocessedData() const { return chunkSize != 0; }
+
+	protected:
+		//! Construct a framer from the framing parameters of target
+		explicit MessageFramer(const ParameterSet& target);
+
+		//! Return the size of the frame starting at data, or 0 and the amount of data required to know it; return 0 as well if the frame is invalid, after failing the stream
+		size_t frameSize(Stream* stream, const unsigned char* data, size_t size, size_t& needed) const;
+
+		//! Return the delimiter byte described by value
+		static unsigned char parseDelimiter(const std::string& value);
+
+		//! Return whether frames end with a delimiter rather than having a length field
+		bool isDelimited() const { return mode == Delimited || mode == Lines; }
+
+		//! Return the message part of a complete frame
+		void extract(const unsigned char* frame, size_t frameSize, const unsigned char*& message, size_t& size) const;
+	};
+
 	//! The system-neutral part of packet stream that implement the actual memory buffers
 	class MemoryPacketStream : public PacketStream
 	{
 	protected:
+		// clang-format off
+		//! Packet stream constants
+		enum Consts
+		{
+			MAX_RETAINED_SEND_BUFFER_SIZE = 65536 //!< after sending a larger packet, the memory of the send buffer is freed
+		};
+		// clang-format on
+
 		//! The buffer collecting data to send
 		ExpandableBuffer sendBuffer;
-		//! The buffer holding data from last receive
-		std::deque<unsigned char> receptionBuffer;
+		//! The buffer holding data from last receive, its capacity is kept between packets
+		std::vector<unsigned char> receptionBuffer;
+		//! The position of the next byte to read in receptionBuffer
+		size_t receptionPos;
 
 	public:
 		//! Constructor
 		explicit MemoryPacketStream(const std::string& protocolName) :
 			Stream(protocolName),
-			PacketStream(protocolName) {}
+			PacketStream(protocolName),
+			receptionPos(0) {}
+
+		//! Replace the data to read by the payload of a received packet
+		void setReceived(const unsigned char* data, size_t size)
+		{
+			receptionBuffer.assign(data, data + size);
+			receptionPos = 0;
+		}
 
 		virtual void write(const void* data, const size_t size);
 
@@ -100,21 +295,51 @@ namespace Dashel
 		// clang-format on
 
 		virtual void read(void* data, size_t size);
+
+		virtual size_t readSome(void* data, size_t size);
+
+		virtual void sendSegmented(const IPV4Address& dest, size_t segmentSize);
+
+	protected:
+		//! Remove the data of a sent packet from the send buffer, only keeping memory for packets of usual sizes
+		void clearSendBuffer()
+		{
+			if (sendBuffer.reservedSize() > MAX_RETAINED_SEND_BUFFER_SIZE)
+				sendBuffer.release();
+			else
+				sendBuffer.clear();
+		}
 	};
 
 
+	//! Parse a boolean parameter value: true, false, 1 or 0; return false if value is invalid
+	bool parseParameter(const std::string& value, bool& result);
+	//! Parse an integer parameter value, return false if value does not start with a number or is out of range
+	bool parseParameter(const std::string& value, int& result);
+	//! Parse an integer parameter value, return false if value does not start with a number or is out of range
+	bool parseParameter(const std::string& value, unsigned& result);
+	//! Parse an integer parameter value, return false if value does not start with a number or is out of range
+	bool parseParameter(const std::string& value, long& result);
+	//! Parse an integer parameter value, return false if value does not start with a number or is out of range
+	bool parseParameter(const std::string& value, unsigned long& result);
+	//! Parse an integer parameter value, return false if value does not start with a number or is out of range
+	bool parseParameter(const std::string& value, long long& result);
+	//! Parse an integer parameter value, return false if value does not start with a number or is out of range
+	bool parseParameter(const std::string& value, unsigned long long& result);
+	//! Parse a floating-point parameter value, return false if value does not start with a number
+	bool parseParameter(const std::string& value, float& result);
+	//! Parse a floating-point parameter value, return false if value does not start with a number
+	bool parseParameter(const std::string& value, double& result);
+
 	template<typename T>
 	T ParameterSet::get(const char* key) const
 	{
 		T t;
-		std::map<std::string, std::string>::const_iterator it = values.find(key);
-		if (it == values.end())
+		if (!parseParameter(get(key), t))
 		{
-			std::string r = std::string("Parameter missing: ").append(key);
+			std::string r = std::string("Invalid value for parameter: ").append(key);
 			throw Dashel::DashelException(DashelException::InvalidTarget, 0, r.c_str());
 		}
-		std::istringstream iss(it->second);
-		iss >> std::boolalpha >> t;
 		return t;
 	}
 }
@@ -94,15 +94,6 @@ namespace Dashel
 	} EvType;
 	// clang-format on
 
-	//! Asserts a dynamic cast.	Similar to the one in boost/cast.hpp
-	template<typename Derived, typename Base>
-	inline Derived polymorphic_downcast(Base base)
-	{
-		Derived derived = dynamic_cast<Derived>(base);
-		assert(derived);
-		return derived;
-	}
-
 	void Stream::fail(DashelException::Source s, int se, const char* reason)
 	{
 		char sysMessage[1024] = { 0 };
@@ -114,8 +105,10 @@ namespace Dashel
 		failReason = reason;
 		failReason += " ";
 		failReason += sysMessage;
+		failSource = s;
 
-		throw DashelException(s, se, failReason.c_str(), this);
+		if (throwOnFailure)
+			throw DashelException(s, se, failReason.c_str(), this);
 	}
 
 	// Serial port enumerator
@@ -226,6 +219,9 @@ namespace Dashel
 		//! Flag indicating whether a read was performed.
 		bool readDone;
 
+		//! Flag indicating whether the Hub must not wait for data on this stream, see Hub::pauseReading().
+		bool readingPaused;
+
 	protected:
 		//! Event for notifying end of stream (i.e. disconnect)
 		HANDLE hEOF;
@@ -252,8 +248,10 @@ namespace Dashel
 	public:
 		//! Constructor.
 		WaitableStream(const std::string& protocolName) :
-			Stream(protocolName)
+			Stream(protocolName),
+			readingPaused(false)
 		{
+			platformStream = this;
 			hEOF = createEvent(EvClosed);
 		}
 
@@ -372,6 +370,7 @@ namespace Dashel
 				if (trg == SOCKET_ERROR)
 				{
 					fail(DashelException::ConnectionFailed, WSAGetLastError(), "Cannot accept incoming connection on socket.");
+					return;
 				}
 
 				// create stream
@@ -488,6 +487,7 @@ namespace Dashel
 				if ((r = ReadFile(hf, ptr, left, &len, NULL)) == 0)
 				{
 					fail(DashelException::IOError, GetLastError(), "Read error from standard input.");
+					return;
 				}
 				else
 				{
@@ -540,6 +540,7 @@ namespace Dashel
 				if ((r = WriteFile(hf, ptr, left, &len, NULL)) == 0)
 				{
 					fail(DashelException::IOError, GetLastError(), "Write error to standard output.");
+					return;
 				}
 				else
 				{
@@ -683,6 +684,7 @@ namespace Dashel
 								{
 									SetEvent(hEOF);
 									fail(DashelException::IOError, GetLastError(), "Cannot write to file (max retry reached).");
+									return;
 								}
 								else
 									continue;
@@ -693,7 +695,7 @@ namespace Dashel
 
 						default:
 							fail(DashelException::IOError, GetLastError(), "Cannot write to file.");
-							break;
+							return;
 					}
 				}
 				else
@@ -729,7 +731,10 @@ namespace Dashel
 
 			DWORD dataUsed;
 			if (!GetOverlappedResult(hf, &ovl, &dataUsed, TRUE))
+			{
 				fail(DashelException::IOError, GetLastError(), "File read I/O error.");
+				return;
+			}
 
 			if (dataUsed)
 			{
@@ -755,12 +760,15 @@ namespace Dashel
 					{
 						case ERROR_HANDLE_EOF:
 							fail(DashelException::ConnectionLost, GetLastError(), "Reached end of file.");
-							break;
+							return;
 
 						case ERROR_IO_PENDING:
 							WaitForSingleObject(ovl.hEvent, INFINITE);
 							if (!GetOverlappedResult(hf, &o, &len, TRUE))
+							{
 								fail(DashelException::IOError, GetLastError(), "File read I/O error.");
+								return;
+							}
 							if (len == 0)
 								return;
 
@@ -770,7 +778,7 @@ namespace Dashel
 
 						default:
 							fail(DashelException::IOError, GetLastError(), "File read I/O error.");
-							break;
+							return;
 					}
 				}
 				else
@@ -1163,6 +1171,7 @@ namespace Dashel
 				if (len == SOCKET_ERROR)
 				{
 					fail(DashelException::ConnectionLost, GetLastError(), "Connection lost on write.");
+					return;
 				}
 				else
 				{
@@ -1213,6 +1222,7 @@ namespace Dashel
 				{
 					//std::cerr << "socket error" << std::endl;
 					fail(DashelException::ConnectionLost, GetLastError(), "Connection lost on read.");
+					return;
 				}
 				else if (len == 0)
 				{
@@ -1234,6 +1244,42 @@ namespace Dashel
 			if (rv == SOCKET_ERROR)
 				throw DashelException(DashelException::ConnectionFailed, WSAGetLastError(), "Cannot select socket events.");
 		}
+
+		virtual size_t readSome(void* data, size_t size)
+		{
+			char* ptr = (char*)data;
+			size_t left = size;
+
+			if (size == 0)
+				return 0;
+
+			readDone = true;
+			readyToRead = false;
+
+			if (readByteAvailable)
+			{
+				*ptr++ = readByte;
+				readByteAvailable = false;
+				left--;
+			}
+
+			// only receive what is already there, so that recv does not block
+			u_long available = 0;
+			if (left && ioctlsocket(sock, FIONREAD, &available) == 0 && available > 0)
+			{
+				int len = recv(sock, ptr, (int)std::min<size_t>(left, available), 0);
+				if (len == SOCKET_ERROR)
+					fail(DashelException::ConnectionLost, GetLastError(), "Connection lost on read.");
+				else
+					left -= len;
+			}
+
+			int rv = WSAEventSelect(sock, hev, FD_READ | FD_CLOSE);
+			if (rv == SOCKET_ERROR)
+				throw DashelException(DashelException::ConnectionFailed, WSAGetLastError(), "Cannot select socket events.");
+
+			return size - left;
+		}
 	};
 
 	//! Poll a socket file descriptor for either a local socket (tcppoll:sock=N) or a
@@ -1334,6 +1380,14 @@ namespace Dashel
 
 				IPV4Address bindAddress(target.get("address"), target.get<int>("port"));
 
+				// let several members of a multicast group on this host share the port
+				if (target.isSet("group"))
+				{
+					BOOL flag = TRUE;
+					if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char*)&flag, sizeof(flag)) == SOCKET_ERROR)
+						throw DashelException(DashelException::ConnectionFailed, WSAGetLastError(), "Cannot set address reuse flag on socket.");
+				}
+
 				// bind
 				sockaddr_in addr;
 				addr.sin_family = AF_INET;
@@ -1364,6 +1418,8 @@ namespace Dashel
 			int broadcastPermission = 1;
 			setsockopt(sock, SOL_SOCKET, SO_BROADCAST, (const char*)&broadcastPermission, sizeof(broadcastPermission));
 
+			setupMulticast();
+
 			// Create and register event.
 			hev = createEvent(EvData);
 
@@ -1372,6 +1428,46 @@ namespace Dashel
 				throw DashelException(DashelException::ConnectionFailed, WSAGetLastError(), "Cannot select socket events.");
 		}
 
+		//! Join the multicast group and set the multicast options given in target, if any
+		void setupMulticast()
+		{
+			struct in_addr interfaceAddr;
+			interfaceAddr.s_addr = htonl(INADDR_ANY);
+			if (target.isSet("iface"))
+			{
+				interfaceAddr.s_addr = htonl(IPV4Address(target.get("iface"), 0).address);
+				if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, (const char*)&interfaceAddr, sizeof(interfaceAddr)) == SOCKET_ERROR)
+					throw DashelException(DashelException::ConnectionFailed, WSAGetLastError(), "Cannot set multicast interface.");
+			}
+
+			if (target.isSet("group"))
+			{
+				const IPV4Address groupAddress(target.get("group"), 0);
+				if (!IN_MULTICAST(groupAddress.address))
+					throw DashelException(DashelException::InvalidTarget, 0, "Group is not a multicast address.");
+
+				struct ip_mreq membership;
+				membership.imr_multiaddr.s_addr = htonl(groupAddress.address);
+				membership.imr_interface = interfaceAddr;
+				if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char*)&membership, sizeof(membership)) == SOCKET_ERROR)
+					throw DashelException(DashelException::ConnectionFailed, WSAGetLastError(), "Cannot join multicast group.");
+			}
+
+			if (target.isSet("ttl"))
+			{
+				DWORD ttl = target.get<unsigned>("ttl");
+				if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, (const char*)&ttl, sizeof(ttl)) == SOCKET_ERROR)
+					throw DashelException(DashelException::ConnectionFailed, WSAGetLastError(), "Cannot set multicast time-to-live.");
+			}
+
+			if (target.isSet("loop"))
+			{
+				DWORD loop = target.get<bool>("loop") ? 1 : 0;
+				if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, (const char*)&loop, sizeof(loop)) == SOCKET_ERROR)
+					throw DashelException(DashelException::ConnectionFailed, WSAGetLastError(), "Cannot set multicast loopback.");
+			}
+		}
+
 		virtual ~UDPSocketStream()
 		{
 			closesocket(sock);
@@ -1388,7 +1484,7 @@ namespace Dashel
 			if (sendto(sock, (const char*)sendBuffer.get(), sendBuffer.size(), 0, (struct sockaddr*)&addr, sizeof(addr)) != sendBuffer.size())
 				fail(DashelException::IOError, WSAGetLastError(), "UDP Socket write I/O error.");
 
-			sendBuffer.clear();
+			clearSendBuffer();
 		}
 
 		virtual void receive(IPV4Address& source)
@@ -1400,16 +1496,21 @@ namespace Dashel
 
 			int recvCount = recvfrom(sock, (char*)buf, 4096, 0, (struct sockaddr*)&addr, &addrLen);
 			if (recvCount <= 0)
+			{
 				fail(DashelException::ConnectionLost, WSAGetLastError(), "UDP Socket read I/O error.");
+				return;
+			}
 
-			receptionBuffer.resize(recvCount);
-			std::copy(buf, buf + recvCount, receptionBuffer.begin());
+			setReceived(buf, recvCount);
 
 			source = IPV4Address(ntohl(addr.sin_addr.s_addr), ntohs(addr.sin_port));
 		}
 	};
 
 	Hub::Hub(const bool resolveIncomingNames) :
+		spinDuration(0),
+		cpuAffinityPending(false),
+		slowHandlerThreshold(0),
 		resolveIncomingNames(resolveIncomingNames)
 	{
 		hTerminate = CreateEvent(NULL, TRUE, FALSE, NULL);
@@ -1419,6 +1520,10 @@ namespace Dashel
 			abort();
 		}
 		streamsLock = CreateMutex(NULL, FALSE, NULL);
+		bufferPool = 0;
+		stepBuffers = 0;
+		hWakeup = 0;
+		workerPool = 0;
 		if (!streamsLock)
 		{
 			std::cerr << "Cannot create streamsLock mutex, error " << GetLastError() << std::endl;
@@ -1452,12 +1557,20 @@ namespace Dashel
 			throw DashelException(DashelException::InvalidTarget, 0, r.c_str());
 		}
 
+		// listening streams are rejected as well, as their connections would not inherit framing
+		if (s->target.isSet("framing") && s->target.get("framing") != "none")
+		{
+			delete s;
+			throw DashelException(DashelException::InvalidTarget, 0, "Message framing is not supported on this platform.");
+		}
+
 		/* The caller must have the stream lock held */
 
 		streams.insert(s);
 		if (proto != "tcpin")
 		{
 			dataStreams.insert(s);
+			DASHEL_STAT(++statistics.connectionsCreated);
 			connectionCreated(s);
 		}
 		return s;
@@ -1469,9 +1582,36 @@ namespace Dashel
 			;
 	}
 
+	//! Return the time of a monotonic clock, in nanoseconds
+	static unsigned long long monotonicNanoseconds()
+	{
+		LARGE_INTEGER counter, frequency;
+		QueryPerformanceCounter(&counter);
+		QueryPerformanceFrequency(&frequency);
+		return (unsigned long long)(counter.QuadPart / frequency.QuadPart) * 1000000000ULL + (unsigned long long)(counter.QuadPart % frequency.QuadPart) * 1000000000ULL / frequency.QuadPart;
+	}
+
+	void Hub::applyCpuAffinity()
+	{
+		cpuAffinityPending = false;
+		DWORD_PTR mask = 0;
+		for (size_t i = 0; i < cpuAffinity.size(); ++i)
+		{
+			if (cpuAffinity[i] >= sizeof(DWORD_PTR) * 8)
+				throw DashelException(DashelException::InvalidOperation, 0, "CPU index out of range.");
+			mask |= DWORD_PTR(1) << cpuAffinity[i];
+		}
+		if (SetThreadAffinityMask(GetCurrentThread(), mask) == 0)
+			throw DashelException(DashelException::InvalidOperation, GetLastError(), "Cannot set CPU affinity of Hub thread.");
+	}
+
 	bool Hub::step(const int timeout)
 	{
+		if (cpuAffinityPending)
+			applyCpuAffinity();
+
 		lock();
+		DASHEL_STAT(++statistics.steps);
 		const std::size_t default_hc = std::max(streams.size(), std::size_t(1));
 
 		std::vector<HANDLE> hEvs(default_hc, hTerminate);
@@ -1490,7 +1630,11 @@ namespace Dashel
 			// Collect all events from all our streams.
 			for (std::set<Stream*>::iterator it = streams.begin(); it != streams.end(); ++it)
 			{
-				WaitableStream* stream = polymorphic_downcast<WaitableStream*>(*it);
+				WaitableStream* stream = static_cast<WaitableStream*>((*it)->platformStream);
+				assert(stream == dynamic_cast<WaitableStream*>(*it));
+				// events of paused streams remain signaled until they resume
+				if (stream->readingPaused)
+					continue;
 				for (std::map<EvType, HANDLE>::iterator ei = stream->hEvents.begin(); ei != stream->hEvents.end(); ++ei)
 				{
 					if (hEvs.size() <= hc)
@@ -1515,9 +1659,13 @@ namespace Dashel
 			// Check for error or timeout.
 			if (r == WAIT_FAILED)
 				throw DashelException(DashelException::SyncError, 0, "Wait failed.");
+			DASHEL_STAT(++statistics.polls; if (r != WAIT_TIMEOUT) ++statistics.pollWakeups);
 
 			// Relock for manipulating streams and calling callbacks
 			lock();
+#ifndef DASHEL_NO_STATS
+			const unsigned long long waitReturn(monotonicNanoseconds());
+#endif
 
 			if (r == WAIT_TIMEOUT)
 			{
@@ -1560,6 +1708,10 @@ namespace Dashel
 				// Notify user that something happended.
 				if (ets[r] == EvData)
 				{
+#ifndef DASHEL_NO_STATS
+					const unsigned long long handlerStart(monotonicNanoseconds());
+					latencyHistograms.dispatchDelay.record(handlerStart - waitReturn);
+#endif
 					try
 					{
 						strs[r]->readDone = false;
@@ -1569,6 +1721,16 @@ namespace Dashel
 					catch (const DashelException& e)
 					{
 					}
+#ifndef DASHEL_NO_STATS
+					const unsigned long long handlerTime(monotonicNanoseconds() - handlerStart);
+					++strs[r]->statistics.handlerCalls;
+					strs[r]->statistics.handlerTime += handlerTime;
+					++statistics.handlerCalls;
+					statistics.handlerTime += handlerTime;
+					latencyHistograms.handler.record(handlerTime);
+					if (slowHandlerThreshold && handlerTime >= slowHandlerThreshold)
+						slowHandler(strs[r], handlerTime);
+#endif
 					if (!strs[r]->readDone)
 					{
 						unlock();
@@ -1594,11 +1756,38 @@ namespace Dashel
 				}
 			}
 
+#ifndef DASHEL_NO_STATS
+			latencyHistograms.iteration.record(monotonicNanoseconds() - waitReturn);
+#endif
+
 			// No more timeouts on following rounds.
 			ms = 0;
 		} while (true);
 	}
 
+	void Hub::closeStream(Stream* stream)
+	{
+		streams.erase(stream);
+		if (dataStreams.erase(stream))
+			DASHEL_STAT(++statistics.connectionsClosed);
+		delete stream;
+	}
+
+	void Hub::setWorkerThreads(unsigned count)
+	{
+		// handlers always run in step() on Windows
+	}
+
+	void Hub::pauseReading(Stream* stream)
+	{
+		static_cast<WaitableStream*>(stream->platformStream)->readingPaused = true;
+	}
+
+	void Hub::resumeReading(Stream* stream)
+	{
+		static_cast<WaitableStream*>(stream->platformStream)->readingPaused = false;
+	}
+
 	void Hub::lock()
 	{
 		DWORD waitRet = WaitForSingleObject(streamsLock, INFINITE);
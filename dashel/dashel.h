@@ -49,6 +49,7 @@
 #include <vector>
 #include <deque>
 #include <stdexcept>
+#include <cstring>
 
 /*!	\file dashel.h
 	\brief Public interface of Dashel, A cross-platform DAta Stream Helper Encapsulation Library
@@ -87,6 +88,7 @@
 	This string consists of the type of the target, a colon, followed by a semicolon separated list of parameters.
 	This list contains key-values pairs, with a predifined order such that keys can be omitted (but if a key is present, all subsequent entries must have an explicit key).
 	Its general syntax is thus \c "protocol:[param1key=]param1value;...;[paramNkey=]paramNvalue".
+	Boolean parameters accept the values true, false, 1 and 0; numeric parameters that are not numbers make the connection fail.
 
 	The following protocols are available:
 	\li \c file : local files
@@ -97,6 +99,8 @@
 	\li \c ser : serial port
 	\li \c stdin : standard input
 	\li \c stdout : standard output
+	\li \c mem and \c memin : in-process client and server (see Section \ref MemorySec)
+	\li \c netsim : simulation of a constrained link for packet streams (see Section \ref NetSimSec)
 
 	The file protocol accepts the following parameters, in this implicit order:
 	\li \c name : name of the file, including the path
@@ -107,6 +111,12 @@
 	\li \c port : remote port
 	\li \c socket : local socket; if a nonegative value is given, host and port are ignored
 
+	On Linux, the tcp and udp protocols also accept the following parameters, that must be given with their key
+	and that tcpin passes to its incoming connections:
+	\li \c busyPoll : time in microseconds during which the system busy-polls the network device when reading, default 0 (see SO_BUSY_POLL)
+	\li \c preferBusyPoll : whether the system should prefer busy-polling to interrupts when busyPoll is set, default false
+	Used along with Hub::setSpinDuration(), they reduce the latency of waking up on incoming data.
+
 	The tcpin protocol accepts the following parameters, in this implicit order:
 	\li \c port : port
 	\li \c address : if the computer possesses multiple network addresses, the one to listen on, default 0.0.0.0 (any)
@@ -119,6 +129,14 @@
 	The udp protocol accepts the following parameters, in this implicit order:
 	\li \c port : port
 	\li \c address : if the computer possesses multiple network addresses, the one to connect to, default 0.0.0.0 (any)
+	It also accepts the following multicast parameters, that must be given with their key:
+	\li \c group : multicast group to join, such as 239.0.0.1; datagrams sent to it are received by all its members
+	\li \c iface : address of the network interface used to join the group and to send multicast datagrams, default any
+	\li \c ttl : time-to-live of multicast datagrams sent, default 1 (local network)
+	\li \c loop : whether multicast datagrams sent are also received on this host, default true
+	To send a datagram once to all members of a group, pass the group address to PacketStream::send().
+	On Linux, if the \c gro parameter is true (default false), the system may coalesce datagrams from
+	the same source into a single reception; they are still returned one by one by PacketStream::receive().
 
 	The ser protocol accepts the following parameters, in this implicit order:
 	\li \c device : serial port device name, system specific; either port or device must be given, device has priority if both are given.
@@ -134,6 +152,103 @@
 	If more than one is given, device has priority, then name, and port has the lowest priority.
 
 	Protocols \c stdin and \c stdout do not take any parameter.
+
+	\section MessageFramingSec Message framing
+
+	On POSIX, byte streams (\c file, \c tcp, \c ser, \c stdin) can reassemble messages themselves
+	instead of letting Hub::incomingData() read them.
+	In that case, Hub::incomingMessage() is called once for every complete message, and never blocks waiting for the rest of a message.
+	When given to \c tcpin, these parameters apply to the incoming connections.
+	Message framing is enabled by the following parameters, that must be given with their key:
+	\li \c framing : encoding of the message length: none (default), u8, u16le, u16be, u32le, u32be, or varint (unsigned LEB128);
+	    or \c line for lines of text, or \c delim for messages ending with a delimiter
+	\li \c framingDelim : delimiter ending messages when framing is delim: a single character, \\n, \\r, \\t, \\0, or 0xNN
+	\li \c framingHeader : size of the message header in bytes, default the size of the length field
+	\li \c framingOffset : position of the length field within the header, default 0
+	\li \c framingInclusive : whether the length counts the header as well, default false
+	\li \c framingMax : size of the largest message accepted, larger ones fail the stream, default 16777216
+	With a plain length prefix, only the payload of the message is passed to Hub::incomingMessage();
+	if \c framingHeader is given, the whole message including its header is passed.
+	Delimited messages are passed without their delimiter, and lines without their trailing \\r\\n or \\n.
+
+	\section SerializationSec Serialization
+
+	StreamWriter encodes values with an explicit byte order into a buffer, and writes a whole message to a stream with a single call;
+	StreamReader decodes values from data read from a stream in a single call, or from a message passed to Hub::incomingMessage().
+	Both use inline functions for single values, and convert arrays in bulk.
+
+	\section MetricsSec Metrics
+
+	On POSIX, the \c metricsin protocol listens for HTTP connections and answers any GET request for
+	\c / or \c /metrics with the counters and histograms of the Hub, in the Prometheus text exposition format
+	(see Hub::formatMetrics()). Requests are served by Hub::step() itself, so that the Hub subclass does not
+	see these connections: neither connectionCreated(), incomingData() nor connectionClosed() is called for them.
+	It accepts the same parameters as \c tcpin, for instance \c metricsin:port=9100, and the metrics can be read
+	with \c curl \c http://localhost:9100/metrics.
+
+	\section MemorySec In-process streams
+
+	On POSIX, the \c memin protocol listens for connections from the same process under a name, for instance \c memin:name=bus,
+	and the \c mem protocol connects to it, for instance \c mem:name=bus. Data go through lock-free memory queues
+	instead of the kernel, so that Hubs running in different threads can exchange data without system calls other than
+	the wakeup of the receiving Hub, which is coalesced until the receiver has consumed the pending data.
+	Both ends behave like a tcp connection: connectionCreated() is called for incoming connections on the Hub of the
+	listener, and closing one end calls connectionClosed() on the other end once it has read all data.
+	Data written are made available to the other end immediately, but it is only woken up by Stream::flush()
+	or once 64 kB have been written. Message framing parameters given to \c memin apply to the incoming connections.
+	Connecting to a name that no stream listens to, or listening to a name already in use, fails.
+
+	\section NetSimSec Network simulation
+
+	On POSIX, the \c netsim protocol wraps a packet stream and passes its packets through a simulated link,
+	for instance \c netsim:latency=100;jitter=20;bw=250000;loss=0.01;inner=udp:port=5000.
+	It runs entirely within the process, so that it needs neither privileges nor system configuration.
+	The \c inner parameter gives the target of the wrapped stream and must come last. Other parameters:
+	\li \c latency : one-way latency in milliseconds, default 0
+	\li \c jitter : maximum random deviation from the latency in milliseconds, default 0; packets keep their order
+	\li \c bw : bandwidth of the link in bits per second, counting payloads only, default 0 (unlimited)
+	\li \c loss : probability for a packet to be dropped, default 0
+	\li \c reorder : probability for a packet to skip latency and jitter, overtaking the packets in flight, default 0
+	\li \c queue : maximum number of packets on the link, further packets being dropped, default 1000
+	\li \c direction : packets going through the simulated link: both (default), out (sent) or in (received)
+	\li \c seed : seed of the random generator, so that runs are reproducible, default 1
+	Each direction has its own link with these parameters. Packets are sent and delivered by Hub::step(),
+	which wakes up when a packet reaches the end of a link; PacketStream::receive() waits for the next packet to arrive.
+
+	\section CaptureSec Capture and replay
+
+	On POSIX, the \c record protocol wraps a byte stream and records all data read from and written to it
+	into a capture file, for instance \c record:file=session.dcap;inner=tcp:host=server;port=1234.
+	The \c inner parameter gives the target of the recorded stream and must come last.
+	Records are pushed into a ring buffer and written to the file by a background thread.
+	Other parameters:
+	\li \c file : name of the capture file, default capture.dcap
+	\li \c bufferSize : size of the ring buffer in bytes, default 4194304; writing waits if the thread is late by the whole buffer
+	Message framing parameters must be given before \c inner and apply to the recorded stream.
+
+	The \c replay protocol reads a capture file and provides the data read from the recorded stream, with their recorded timing,
+	so that Hub::incomingData() or Hub::incomingMessage() can be benchmarked against real traffic.
+	Data written to it are discarded, and it is closed at the end of the capture. Its parameters are, in this implicit order:
+	\li \c file : name of the capture file
+	\li \c speed : replay speed relative to the recording, default 1, or max to replay as fast as possible
+
+	A capture file starts with the 8 bytes \c DSHLCAP1, followed by records made of a monotonic timestamp in nanoseconds (8 bytes),
+	the size of the data (4 bytes), the direction (1 byte, 0 for read data, 1 for written data), and the data.
+	Once recording completes, the records are followed by an index holding the file offset and timestamp (8 bytes each)
+	of every 1024th record, and by a trailer holding the offset of the index (8 bytes), its number of entries (8 bytes),
+	and the 8 bytes \c DSHLIDX1. All numbers are little endian.
+
+	\section TracingSec Tracing
+
+	On POSIX, if \c sys/sdt.h is available when building Dashel, the library contains USDT static tracepoints
+	of the \c dashel provider, which cost a no-op instruction when not traced (disable with the DASHEL_USDT CMake option):
+	\li \c poll__enter (hub, number of file descriptors, timeout) and \c poll__exit (hub, result of poll) around waiting in Hub::step()
+	\li \c accept (hub, listening stream, new file descriptor)
+	\li \c connection__created (hub, stream), \c incoming__data (hub, stream), \c incoming__message (hub, stream, size)
+	    and \c connection__closed (hub, stream, abnormal) before calling the corresponding Hub methods
+	\li \c socket__send and \c socket__recv (stream, file descriptor, result of the system call) for tcp streams
+	\li \c udp__send and \c udp__receive (stream, file descriptor, result of the system call) for udp streams
+	\li \c stream__fail (stream, DashelException::Source, system error code)
 */
 
 //! Dashel, a cross-platform stream abstraction library
@@ -143,9 +258,9 @@ namespace Dashel
 
 	// clang-format off
 	//! version of the Dashel library as string
-	#define DASHEL_VERSION "1.3.3"
+	#define DASHEL_VERSION "2.0.0"
 	//! version of the Dashel library as an int
-	#define DASHEL_VERSION_INT 10303
+	#define DASHEL_VERSION_INT 20000
 	// clang-format on
 
 	//! The one size fits all exception for streams.
@@ -240,12 +355,175 @@ namespace Dashel
 		//bool isValid() const;
 	};
 
+	//! An immutable buffer, that can be written to many streams without being copied.
+	/*!
+		Copies of a SharedBuffer share the same data, which is freed when the last copy is destroyed.
+		Copies can be used and destroyed from different threads.
+	*/
+	class SharedBuffer
+	{
+	private:
+		struct Block;
+		Block* block; //!< the shared data and their reference count, 0 if empty
+
+	public:
+		//! Construct an empty buffer
+		SharedBuffer();
+
+		//! Construct a buffer holding a copy of data, using a single allocation
+		SharedBuffer(const void* data, size_t size);
+
+		//! Construct a buffer sharing the data of that
+		SharedBuffer(const SharedBuffer& that);
+
+		//! Share the data of that, releasing the current ones
+		SharedBuffer& operator=(const SharedBuffer& that);
+
+		//! Release the data, freeing them if this is the last buffer sharing them
+		~SharedBuffer();
+
+		//! Return a pointer to the data
+		const unsigned char* data() const;
+
+		//! Return the size of the data in bytes
+		size_t size() const;
+	};
+
+	//! Performance counters of a stream.
+	/*!
+		System-level counters are only maintained by streams based on file descriptors and sockets.
+		All counters stay at zero if the library is built with the DASHEL_STATS CMake option disabled.
+	*/
+	struct StreamStats
+	{
+		// clang-format off
+		unsigned long long bytesIn;			//!< Bytes read by the application.
+		unsigned long long bytesOut;		//!< Bytes written by the application.
+		unsigned long long readCalls;		//!< Calls to read() and readSome().
+		unsigned long long writeCalls;		//!< Calls to write() and writeShared().
+		unsigned long long syscalls;		//!< System calls transferring data.
+		unsigned long long shortReads;		//!< System reads that returned less data than requested.
+		unsigned long long shortWrites;		//!< System writes that sent less data than requested.
+		unsigned long long wouldBlock;		//!< System calls that returned EAGAIN.
+		unsigned long long handlerCalls;	//!< Activity notifications handled by the Hub for this stream.
+		unsigned long long handlerTime;		//!< Time spent receiving data and in Hub::incomingData() or Hub::incomingMessage() for this stream, in nanoseconds.
+		// clang-format on
+
+		//! Constructor, sets all counters to zero
+		StreamStats();
+	};
+
+	//! Performance counters of a Hub.
+	/*!
+		All counters stay at zero if the library is built with the DASHEL_STATS CMake option disabled.
+	*/
+	struct HubStats
+	{
+		// clang-format off
+		unsigned long long steps;				//!< Calls to Hub::step(), including those from Hub::run().
+		unsigned long long polls;				//!< Waits for activity on the streams.
+		unsigned long long pollWakeups;			//!< Waits for activity that returned with activity.
+		unsigned long long handlerCalls;		//!< Activity notifications handled for all streams.
+		unsigned long long handlerTime;			//!< Time spent handling these notifications, in nanoseconds.
+		unsigned long long connectionsCreated;	//!< Data streams created, including incoming connections.
+		unsigned long long connectionsClosed;	//!< Data streams closed.
+		// clang-format on
+
+		//! Constructor, sets all counters to zero
+		HubStats();
+	};
+
+	//! A histogram of durations, with buckets whose width grows with the duration.
+	/*!
+		Buckets are log-linear, as in HDR histograms: each power of two is split into SUB_BUCKET_COUNT buckets
+		of equal width, so that values are recorded with a relative error below 1/SUB_BUCKET_COUNT,
+		using a fixed amount of memory and without allocation.
+	*/
+	class LatencyHistogram
+	{
+	public:
+		// clang-format off
+		//! Histogram constants
+		enum Consts
+		{
+			SUB_BUCKET_BITS = 4,									//!< log2 of SUB_BUCKET_COUNT
+			SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS,				//!< number of buckets per power of two
+			BUCKET_COUNT = (65 - SUB_BUCKET_BITS) * SUB_BUCKET_COUNT	//!< number of buckets covering 64-bit values
+		};
+		// clang-format on
+
+	private:
+		unsigned long long counts[BUCKET_COUNT]; //!< number of values recorded in each bucket
+		unsigned long long total; //!< number of values recorded
+		unsigned long long totalValue; //!< sum of the values recorded
+		unsigned long long maxValue; //!< largest value recorded
+
+	public:
+		//! Constructor, creates an empty histogram
+		LatencyHistogram();
+
+		//! Record a value, in nanoseconds
+		void record(unsigned long long value);
+
+		//! Remove all recorded values
+		void reset();
+
+		//! Return the number of recorded values
+		unsigned long long count() const { return total; }
+
+		//! Return the sum of the recorded values, in nanoseconds
+		unsigned long long sum() const { return totalValue; }
+
+		//! Return the largest recorded value, in nanoseconds
+		unsigned long long maximum() const { return maxValue; }
+
+		//! Return the value below which a given fraction of the recorded values lie, in nanoseconds
+		/*!
+			\param fraction fraction of values, between 0 and 1 (e.g. 0.99 for the 99th percentile)
+			\return an upper bound of the percentile, within the precision of the buckets, 0 if the histogram is empty
+		*/
+		unsigned long long percentile(double fraction) const;
+
+	protected:
+		//! Return the index of the bucket holding value
+		static size_t bucketIndex(unsigned long long value);
+
+		//! Return the largest value held by a bucket
+		static unsigned long long bucketUpperBound(size_t index);
+	};
+
+	//! Latency histograms of a Hub
+	/*!
+		Histograms stay empty if the library is built with the DASHEL_STATS CMake option disabled.
+	*/
+	struct HubLatencies
+	{
+		// clang-format off
+		LatencyHistogram iteration;		//!< Time spent handling the activity reported by a single poll.
+		LatencyHistogram dispatchDelay;	//!< Time between poll reporting activity on a stream and the Hub handling it.
+		LatencyHistogram handler;		//!< Time spent handling activity on a stream, including incomingData() or incomingMessage().
+		// clang-format on
+	};
+
 	//! Parameter set.
 	class ParameterSet
 	{
 	private:
-		std::map<std::string, std::string> values;
-		std::vector<std::string> params;
+		//! A parameter and its value
+		struct Entry
+		{
+			std::string key; //!< name of the parameter
+			std::string value; //!< value of the parameter
+			bool listed; //!< whether the parameter is part of getString(), which lists them in the order of entries
+		};
+		//! All parameters; there are few of them, so searching a vector is faster and more compact than a map
+		std::vector<Entry> entries;
+
+		//! Return the entry of key, or 0 if there is none
+		const Entry* find(const char* key, size_t keyLength) const;
+
+		//! Return the entry of key, appending it to the parameters if there is none
+		Entry& findOrAppend(const char* key, size_t keyLength);
 
 	public:
 		//! Add values to set.
@@ -259,11 +537,14 @@ namespace Dashel
 		*/
 		void addParam(const char* param, const char* value = NULL, bool atStart = false);
 
+		//! Set the value of a parameter, without adding it to getString() if it is not there yet
+		void setValue(const char* key, const std::string& value);
+
 		//! Return whether a key is set or not
 		bool isSet(const char* key) const;
 
 		//! Get a parameter value.
-		//! Explicitely instantiated for int, unsigned, float and double in the library
+		//! Explicitely instantiated for bool, int, unsigned, float and double in the library; bool accepts true, false, 1 and 0
 		template<typename T>
 		T get(const char* key) const;
 
@@ -285,12 +566,22 @@ namespace Dashel
 		bool failedFlag;
 		//! The human readable reason describing why the stream has failed.
 		std::string failReason;
+		//! The source of the failure, if the stream has failed.
+		DashelException::Source failSource;
 
 	protected:
-		//! The target description.
-		ParameterSet target;
+		//! The target description, mutable so that streams setting targetDeferred can build it on first use.
+		mutable ParameterSet target;
+		//! If true, target is empty until describeTarget() fills it, to save memory on streams whose target is rarely looked at.
+		mutable bool targetDeferred;
+		//! If false, fail() returns after setting the stream to failed state instead of throwing an exception.
+		bool throwOnFailure;
 		//! The protocol name.
 		std::string protocolName;
+		//! The performance counters.
+		StreamStats statistics;
+		//! This stream as the platform-dependant class all streams derive from, set by its constructor so that the Hub does not need dynamic casts.
+		void* platformStream;
 
 	protected:
 		friend class Hub;
@@ -298,14 +589,33 @@ namespace Dashel
 		//! Constructor.
 		explicit Stream(const std::string& protocolName) :
 			failedFlag(false),
-			protocolName(protocolName) {}
+			failSource(DashelException::Unknown),
+			targetDeferred(false),
+			throwOnFailure(true),
+			protocolName(protocolName),
+			platformStream(0) {}
 
 		//! Virtual destructor, to ensure calls to destructors of sub-classes.
 		virtual ~Stream() { /* intentionally blank */}
 
+		// clang-format off
+		//! Fill parameters with the target description, for streams that set targetDeferred.
+		virtual void describeTarget(ParameterSet& parameters) const { /* hook for use by derived classes */ }
+		// clang-format on
+
 	public:
+		// clang-format off
+		//! The outcome of the I/O functions that report errors without throwing exceptions.
+		typedef enum {
+			StatusOk,		//!< The operation completed.
+			StatusClosed,	//!< The connection was lost or the end of file was reached, the stream has failed.
+			StatusFailed	//!< Some other error occurred, the stream has failed.
+		} Status;
+		// clang-format on
+
 		//! Set stream to failed state
-		/*!	\param s Source of failure
+		/*!	Throws a DashelException, except within the try functions, which report the failure through their status.
+			\param s Source of failure
 			\param se System error code
 			\param reason The logical reason as a human readable string.
 		*/
@@ -321,26 +631,51 @@ namespace Dashel
 		*/
 		const std::string& getFailReason() const { return failReason; }
 
+		//!	Returns the source of the failure of the stream.
+		/*!	\return the source of the failure, or DashelException::Unknown if fail() is false.
+		*/
+		DashelException::Source getFailSource() const { return failSource; }
+
 		//! Returns the protocol name of the stream.
 		const std::string& getProtocolName() const { return protocolName; }
 
+		//! Returns a snapshot of the performance counters of the stream.
+		/*!	Counters are not synchronized, call from the thread running the Hub, or with the Hub locked.
+		*/
+		StreamStats stats() const { return statistics; }
+
 		//!	Returns the name of the target.
 		/*!	The name of the target contains all parameters and the protocol name.
 
 			\return Name of the target
 		*/
-		std::string getTargetName() const { return protocolName + ":" + target.getString(); }
+		std::string getTargetName() const { return protocolName + ":" + getTarget().getString(); }
 
 		//! Returns the value of a parameter extracted from the target.
 		/*! \param param the name of the parameter
 			\return A string containing the parameter.
 		*/
-		const std::string& getTargetParameter(const char* param) const { return target.get(param); }
+		const std::string& getTargetParameter(const char* param) const
+		{
+			if (targetDeferred)
+			{
+				describeTarget(target);
+				targetDeferred = false;
+			}
+			return target.get(param);
+		}
 
 		//! Returns the target description.
 		/*! \return The set of parameters describing this target
 		*/
-		const ParameterSet getTarget() const { return target; }
+		const ParameterSet getTarget() const
+		{
+			if (!targetDeferred)
+				return target;
+			ParameterSet parameters;
+			describeTarget(parameters);
+			return parameters;
+		}
 
 		//!	Write data to the stream.
 		/*!	Writes all requested data to the stream, blocking until all the data has been written, or 
@@ -363,6 +698,15 @@ namespace Dashel
 			write(&v, sizeof(T));
 		}
 
+		//!	Write a shared buffer to the stream.
+		/*!	Behaves as write(), but streams that support it keep a reference to the buffer instead of copying
+			its content, and send it along with other buffered data when flushed.
+			The buffer is therefore only guaranteed to be written to physical media or sent over a wire after flush().
+
+			\param buffer The buffer to write.
+		*/
+		virtual void writeShared(const SharedBuffer& buffer);
+
 		//!	Flushes stream.
 		/*!	Calling this function requests the stream to be flushed, this may ensure that data is written
 			to physical media or actually sent over a wire. The exact performed function depends on the
@@ -380,6 +724,56 @@ namespace Dashel
 		*/
 		virtual void read(void* data, size_t size) = 0;
 
+		//!	Reads the data immediately available from the stream.
+		/*!	Reads the data already received by the stream, and whatever a single non-blocking read
+			from the system returns, up to size bytes. Never blocks, and may return 0 if no data
+			is available. Errors, including reaching the end of file or the connection being closed
+			before any data could be read, are signaled by throwing a DashelException exception.
+			Streams that do not support this operation throw an InvalidOperation exception.
+
+			\param data Pointer to the memory where the read data should be stored.
+			\param size Maximum amount of data to read in bytes.
+			\return The amount of data read in bytes.
+		*/
+		virtual size_t readSome(void* data, size_t size);
+
+		//!	Write data to the stream, reporting errors through the returned status.
+		/*!	Behaves as write(), but does not throw an exception when the stream fails, which is cheaper
+			when failures are frequent, for instance when many clients disconnect at once.
+			Once the stream has failed, nothing is written and the status of the failure is returned.
+
+			\param data Pointer to the data to write.
+			\param size Amount of data to write in bytes.
+			\return StatusOk if the data were written, the cause of the failure of the stream otherwise.
+		*/
+		Status tryWrite(const void* data, size_t size);
+
+		//!	Flushes stream, reporting errors through the returned status.
+		/*!	Behaves as flush(), see tryWrite() for the handling of errors.
+			\return StatusOk if the stream was flushed, the cause of the failure of the stream otherwise.
+		*/
+		Status tryFlush();
+
+		//!	Reads data from the stream, reporting errors through the returned status.
+		/*!	Behaves as read(), see tryWrite() for the handling of errors.
+			The content of data is undefined if the stream fails.
+
+			\param data Pointer to the memory where the read data should be stored.
+			\param size Amount of data to read in bytes.
+			\return StatusOk if all data were read, the cause of the failure of the stream otherwise.
+		*/
+		Status tryRead(void* data, size_t size);
+
+		//!	Reads the data immediately available from the stream, reporting errors through the returned status.
+		/*!	Behaves as readSome(), see tryWrite() for the handling of errors.
+
+			\param data Pointer to the memory where the read data should be stored.
+			\param size Maximum amount of data to read in bytes.
+			\param readSize Set to the amount of data read in bytes.
+			\return StatusOk if the stream did not fail, the cause of the failure of the stream otherwise.
+		*/
+		Status tryReadSome(void* data, size_t size, size_t& readSize);
+
 		//! Read a variable of basic type from the stream
 		/*! This function does not perform any endian conversion.
 
@@ -416,6 +810,17 @@ namespace Dashel
 		*/
 		virtual void send(const IPV4Address& dest) = 0;
 
+		//! Send all written data to an IP address as a train of packets of equal size.
+		/*!
+			The data are split into consecutive packets of segmentSize bytes, the last one being possibly shorter.
+			On Linux, UDP streams pass the whole train to the system at once, using segmentation offload when available.
+			Packet streams that do not support this operation throw an InvalidOperation exception.
+
+			\param dest IP address to send packets to
+			\param segmentSize size of each packet in bytes
+		*/
+		virtual void sendSegmented(const IPV4Address& dest, size_t segmentSize);
+
 		//! Receive a packet and make its payload available for reading.
 		/*!
 			Block until a packet is available.
@@ -425,6 +830,214 @@ namespace Dashel
 		virtual void receive(IPV4Address& source) = 0;
 	};
 
+	// clang-format off
+	//! Byte order of the values written by StreamWriter and read by StreamReader
+	typedef enum {
+		LittleEndian,	//!< Least significant byte first.
+		BigEndian		//!< Most significant byte first, also known as network byte order.
+	} ByteOrder;
+	// clang-format on
+
+	//! Return the byte order of the host.
+	inline ByteOrder hostByteOrder()
+	{
+		const unsigned short one(1);
+		return *reinterpret_cast<const unsigned char*>(&one) ? LittleEndian : BigEndian;
+	}
+
+	//! Copy count values of elementSize bytes each from src to dest, reversing the order of the bytes of every value.
+	/*!	Values of 2, 4 and 8 bytes are converted by loops that the compiler can vectorize.
+		dest and src may be the same, but must not overlap otherwise.
+	*/
+	void swapByteOrder(void* dest, const void* src, size_t elementSize, size_t count);
+
+	//! Encodes values with a given byte order into a buffer, and writes them to a stream in a single call.
+	/*!
+		Values are appended by inline functions, without virtual calls, until flush() passes them all to Stream::write().
+		The memory of the buffer is kept after flush(), so that encoding messages of similar sizes does not allocate memory.
+		Data not flushed when the writer is destroyed are discarded.
+
+		\code
+		StreamWriter writer(stream, LittleEndian);
+		writer.write<unsigned short>(payloadSize);
+		writer.write<unsigned short>(source);
+		writer.writeArray(values, valuesCount);
+		writer.flush();
+		\endcode
+	*/
+	class StreamWriter
+	{
+	private:
+		Stream* stream; //!< the stream data are written to
+		bool swap; //!< whether the byte order differs from the one of the host
+		unsigned char* buffer; //!< encoded data
+		size_t _size; //!< amount of encoded data
+		size_t capacity; //!< allocated size of buffer
+
+	public:
+		//! Construct a writer to stream, encoding values with the given byte order
+		explicit StreamWriter(Stream* stream, ByteOrder order = LittleEndian);
+
+		//! Destroy the writer, discarding the data not flushed
+		~StreamWriter();
+
+		//! Append a variable of basic type
+		template<typename T>
+		void write(T v)
+		{
+			unsigned char* dest(reserve(sizeof(T)));
+			if (swap)
+			{
+				const unsigned char* src(reinterpret_cast<const unsigned char*>(&v));
+				for (size_t i = 0; i < sizeof(T); ++i)
+					dest[i] = src[sizeof(T) - 1 - i];
+			}
+			else
+				std::memcpy(dest, &v, sizeof(T));
+			_size += sizeof(T);
+		}
+
+		//! Append an array of variables of basic type
+		template<typename T>
+		void writeArray(const T* values, size_t count)
+		{
+			unsigned char* dest(reserve(sizeof(T) * count));
+			if (swap)
+				swapByteOrder(dest, values, sizeof(T), count);
+			else
+				std::memcpy(dest, values, sizeof(T) * count);
+			_size += sizeof(T) * count;
+		}
+
+		//! Append raw bytes, without conversion
+		void writeBytes(const void* data, size_t size)
+		{
+			std::memcpy(reserve(size), data, size);
+			_size += size;
+		}
+
+		//! Write the appended data to the stream with a single Stream::write() and empty the buffer
+		/*!	This does not flush the stream itself, call Stream::flush() to do so.
+		*/
+		void flush();
+
+		//! Discard the appended data
+		void clear() { _size = 0; }
+
+		//! Return the amount of appended data in bytes
+		size_t size() const { return _size; }
+
+	private:
+		//! Return where to append size bytes, growing the buffer if needed
+		unsigned char* reserve(size_t size) { return _size + size <= capacity ? buffer + _size : grow(size); }
+
+		//! Grow the buffer so that size more bytes fit, return where to append them
+		unsigned char* grow(size_t size);
+
+		// writers own their buffer, they are not copyable
+		StreamWriter(const StreamWriter&);
+		StreamWriter& operator=(const StreamWriter&);
+	};
+
+	//! Decodes values with a given byte order, from data read from a stream in a single call or from memory.
+	/*!
+		fill() reads a whole message from the stream with one Stream::read(), then values are decoded by inline functions, without virtual calls.
+		Reading past the data fails the stream the reader is associated with, if any, and throws a DashelException.
+
+		\code
+		StreamReader reader(stream, LittleEndian);
+		reader.fill(4);
+		const unsigned short payloadSize(reader.read<unsigned short>());
+		const unsigned short source(reader.read<unsigned short>());
+		reader.fill(payloadSize);
+		reader.readArray(values, payloadSize / 2);
+		\endcode
+	*/
+	class StreamReader
+	{
+	private:
+		Stream* stream; //!< the stream data are read from by fill() or come from, 0 if none
+		bool swap; //!< whether the byte order differs from the one of the host
+		const unsigned char* data; //!< data being decoded, either buffer or external memory
+		size_t pos; //!< position of the next value in data
+		size_t _size; //!< size of data
+		unsigned char* buffer; //!< data read by fill()
+		size_t capacity; //!< allocated size of buffer
+
+	public:
+		//! Construct a reader from stream, decoding values with the given byte order
+		explicit StreamReader(Stream* stream, ByteOrder order = LittleEndian);
+
+		//! Construct a reader decoding size bytes of data, which must remain valid while they are decoded
+		/*!	If given, stream is the stream the data come from, for instance in Hub::incomingMessage(), and fails if they are too short.
+		*/
+		StreamReader(const void* data, size_t size, ByteOrder order = LittleEndian, Stream* stream = 0);
+
+		//! Destroy the reader
+		~StreamReader();
+
+		//! Read size bytes from the stream with a single Stream::read(), replacing the data being decoded
+		void fill(size_t size);
+
+		//! Decode size bytes of data, which must remain valid while they are decoded, replacing the data being decoded
+		void reset(const void* data, size_t size);
+
+		//! Decode a variable of basic type
+		template<typename T>
+		T read()
+		{
+			T v;
+			const unsigned char* src(consume(sizeof(T)));
+			if (swap)
+			{
+				unsigned char* dest(reinterpret_cast<unsigned char*>(&v));
+				for (size_t i = 0; i < sizeof(T); ++i)
+					dest[i] = src[sizeof(T) - 1 - i];
+			}
+			else
+				std::memcpy(&v, src, sizeof(T));
+			return v;
+		}
+
+		//! Decode an array of variables of basic type
+		template<typename T>
+		void readArray(T* values, size_t count)
+		{
+			// counts decoded from received data may be large enough for their size in bytes to overflow
+			if (count > remaining() / sizeof(T))
+				underflow();
+			const unsigned char* src(consume(sizeof(T) * count));
+			if (swap)
+				swapByteOrder(values, src, sizeof(T), count);
+			else
+				std::memcpy(values, src, sizeof(T) * count);
+		}
+
+		//! Copy raw bytes, without conversion
+		void readBytes(void* dest, size_t size) { std::memcpy(dest, consume(size), size); }
+
+		//! Return the amount of data left to decode in bytes
+		size_t remaining() const { return _size - pos; }
+
+	private:
+		//! Return the next size bytes and skip them, throw if there are not enough data left
+		const unsigned char* consume(size_t size)
+		{
+			if (size > _size - pos)
+				underflow();
+			const unsigned char* src(data + pos);
+			pos += size;
+			return src;
+		}
+
+		//! Fail the stream and throw the exception of reading past the data
+		void underflow() const;
+
+		// readers own their buffer, they are not copyable
+		StreamReader(const StreamReader&);
+		StreamReader& operator=(const StreamReader&);
+	};
+
 	/**
 		The central place where to create, destroy, and synchronize streams.
 		To create a client connection, users of the library have to subclass Hub
@@ -440,7 +1053,17 @@ namespace Dashel
 		// clang-format off
 		void* hTerminate;	//!< Set when this thing goes down.
 		void* streamsLock; 	//!< Platform-dependant mutex to protect access to streams
+		void* bufferPool;	//!< Platform-dependant pool of buffers lent to streams while they hold data
+		void* stepBuffers;	//!< Platform-dependant arrays reused by step(), so that it does not allocate memory
+		void* hWakeup;		//!< Platform-dependant event waking step() up when a stream resumes reading or a worker thread completes
+		void* workerPool;	//!< Platform-dependant threads running handlers, 0 if handlers run in step()
 		StreamsSet streams; //!< All our streams.
+		unsigned spinDuration; //!< Time in microseconds during which step() polls without blocking before waiting.
+		std::vector<unsigned> cpuAffinity; //!< CPUs on which the thread running step() is allowed to run, all if empty.
+		bool cpuAffinityPending; //!< Whether cpuAffinity must be applied to the thread running step() on its next call.
+		HubStats statistics; //!< Performance counters.
+		HubLatencies latencyHistograms; //!< Latency histograms.
+		unsigned long long slowHandlerThreshold; //!< Duration in nanoseconds above which slowHandler() is called, 0 to disable.
 		// clang-format on
 
 	protected:
@@ -451,7 +1074,8 @@ namespace Dashel
 
 	public:
 		/** Constructor.
-			\param resolveIncomingNames if true, try to resolve the peer's hostname of incoming TCP connections
+			\param resolveIncomingNames if true, try to resolve the peer's hostname of incoming TCP connections;
+			on POSIX, the name is resolved when the target of the connection is first looked at, not when it is accepted
 		*/
 		explicit Hub(const bool resolveIncomingNames = true);
 
@@ -473,6 +1097,7 @@ namespace Dashel
 		/**
 			Close a stream, remove it from the Hub, and delete it.
 			If the stream is not present in the Hub, it is deleted nevertheless.
+			If a worker thread is running its handlers, it is deleted once they return (see setWorkerThreads()).
 			Note that connectionClosed() is not called by closeStream() and that
 			you must not call closeStream() from inside connectionCreated(),
 			connectionClosed() or incomingData().
@@ -481,6 +1106,18 @@ namespace Dashel
 		*/
 		void closeStream(Stream* stream);
 
+		/**
+			Write a buffer to several streams and flush them.
+			Streams that fail do not prevent the buffer from being written to the other streams;
+			they are reported to connectionClosed() and closed during the next step().
+			The buffer is shared, and not copied, by streams supporting it.
+
+			\param buffer buffer to write
+			\param streams streams to write to, for instance dataStreams
+			\return the number of streams that failed
+		*/
+		size_t broadcast(const SharedBuffer& buffer, const StreamsSet& streams);
+
 		/** Runs and returns only when an external event requests the application to stop.
 		*/
 		void run();
@@ -497,6 +1134,88 @@ namespace Dashel
 		//! Stops running, subclasses or external code may call this function, that is the only thread-safe function of the Hub
 		void stop();
 
+		/** Set the busy-polling duration of step().
+			When step() is allowed to wait, it first checks for activity without blocking during this duration,
+			and only then waits for the rest of the timeout. This trades CPU time for wake-up latency,
+			and is best used with a Hub running on a dedicated core. Ignored on Windows.
+
+			\param microseconds spin duration in microseconds, 0 (default) to wait immediately
+		*/
+		void setSpinDuration(unsigned microseconds);
+
+		/** Set the CPUs on which the thread running this Hub is allowed to run.
+			The affinity is applied to the thread that next calls step() or run(),
+			so this function must be called before run(), or from the thread running the Hub.
+			As stream buffers are allocated by the thread that first uses them, streams created
+			or first written to from a pinned Hub thread get their memory on that thread's NUMA node.
+
+			\param cpus indices of the allowed CPUs; if empty, the affinity of the thread is left unchanged
+		*/
+		void setCpuAffinity(const std::vector<unsigned>& cpus);
+
+		/** Return a snapshot of the performance counters of this Hub.
+			Counters are not synchronized, call from the thread running the Hub, or with the Hub locked.
+			Use Stream::stats() for the counters of individual streams.
+		*/
+		HubStats stats() const { return statistics; }
+
+		/** Return the latency histograms of this Hub.
+			Histograms are not synchronized, call from the thread running the Hub, or with the Hub locked.
+		*/
+		const HubLatencies& latencies() const { return latencyHistograms; }
+
+		//! Clear the latency histograms of this Hub
+		void resetLatencies();
+
+		/** Append the counters and histograms of this Hub and of its data streams to text,
+			in the Prometheus text exposition format.
+			Call from the thread running the Hub, or with the Hub locked.
+			The metricsin protocol serves this text over HTTP (see Section \ref MetricsSec).
+		*/
+		void formatMetrics(std::string& text) const;
+
+		/** Set the duration above which handling activity on a stream is reported to slowHandler().
+			\param nanoseconds duration threshold in nanoseconds, 0 (default) to disable reports
+		*/
+		void setSlowHandlerThreshold(unsigned long long nanoseconds);
+
+		/** Run incomingData() and incomingMessage() on a pool of worker threads, while step() only does I/O.
+			When data arrive on a stream, step() receives them and hands the stream over to a worker thread,
+			which calls the handlers until the data are consumed. The stream is not polled until then, so
+			the handlers of a stream are called in order and never concurrently, while different streams are
+			handled in parallel. Handlers running on worker threads are not called with the stream lock held;
+			they may use their own stream, and must lock the Hub to use the Hub or other streams,
+			which must not be used concurrently by the handlers of these other streams.
+			A stream closed with closeStream() while its handlers run is deleted once they return.
+			Exceptions other than DashelException thrown by these handlers are rethrown by step(),
+			or by setWorkerThreads() when stopping the threads; if several are thrown, only the first one is.
+			Call from the thread running the Hub, outside of step(), and with count 0 before the destructor of
+			the subclass returns if worker threads were used, so that they do not call its handlers any more.
+			Ignored on Windows.
+
+			\param count number of worker threads; if 0 (default), handlers run in step()
+		*/
+		void setWorkerThreads(unsigned count);
+
+		/** Stop reading a stream until resumeReading() is called.
+			The Hub stops polling the stream, so incomingData() and incomingMessage() are not called for it,
+			and incoming data remain in the buffers of the system; for TCP, flow control then slows the sender down.
+			Data already received by Dashel are delivered after resuming, and so is the closing of
+			the connection by the remote end. Pausing a listening stream stops accepting connections.
+			Call from the thread running the Hub, for instance from incomingData(), or with the Hub locked.
+
+			\param stream stream to pause, that must belong to this Hub
+		*/
+		void pauseReading(Stream* stream);
+
+		/** Resume reading a stream paused by pauseReading().
+			On POSIX, a step() waiting for activity is woken up; on Windows, the stream is served from its next wait.
+			Call from the thread running the Hub, or with the Hub locked.
+
+			\param stream stream to resume, that must belong to this Hub
+		*/
+		void resumeReading(Stream* stream);
+
 		/** Block any hub processing so another thread can access the streams safely.
 		 */
 		void lock();
@@ -505,6 +1224,25 @@ namespace Dashel
 		*/
 		void unlock();
 
+	private:
+		//! Apply cpuAffinity to the calling thread, called by step()
+		void applyCpuAffinity();
+
+		//! Set up message framing on a newly created stream and add it to the Hub, called by connect() and step()
+		Stream* addStream(Stream* stream, bool isListening);
+
+		//! Call incomingData() or incomingMessage() until the received data are consumed or reading is paused, called by step() or a worker thread
+		void deliverReceivedData(Stream* stream);
+
+		//! Make the streams whose data were delivered by worker threads pollable again, return whether there were any; called by step() and setWorkerThreads()
+		bool finishWorkerTasks();
+
+		//! Entry point of worker threads, see setWorkerThreads()
+		static void* runWorker(void* hub);
+
+		//! Update the counters and histograms after handling activity on a stream, and report slow handlers
+		void recordHandlerTime(Stream* stream, unsigned long long handlerTime);
+
 	protected:
 		// clang-format off
 		/**
@@ -525,12 +1263,26 @@ namespace Dashel
 			method and calls connectionClosed(); objects dynamically allocated must thus be handled
 			with auto_ptr.
 			If step() is used, subclass must implement this method and call read at least once.
-			Called with the stream lock held.
+			Called with the stream lock held, unless it runs on a worker thread (see setWorkerThreads()).
 
 			\param stream stream to the target
 		*/
 		virtual void incomingData(Stream* stream) { /* hook for use by derived classes */ }
 
+		/**
+			Called when a complete message has been received on a stream with message framing
+			(see Section \ref MessageFramingSec); in that case, incomingData() is not called for this stream.
+			The message is only valid during the call, and the stream must not be read from.
+			If the stream is closed during this method, an exception occurs, as for incomingData().
+			Subclass can implement this method.
+			Called with the stream lock held, unless it runs on a worker thread (see setWorkerThreads()).
+
+			\param stream stream to the target
+			\param data pointer to the message
+			\param size size of the message in bytes
+		*/
+		virtual void incomingMessage(Stream* stream, const void* data, size_t size) { /* hook for use by derived classes */ }
+
 		/**
 			Called when target closes connection.
 			The only valid method to call on the stream is getTargetName(), input/output operations are forbidden.
@@ -543,6 +1295,19 @@ namespace Dashel
 			\param abnormal whether the connection was closed during step (abnormal == false) or when an operation was performed (abnormal == true)
 		*/
 		virtual void connectionClosed(Stream* stream, bool abnormal) { /* hook for use by derived classes */ }
+
+		/**
+			Called when handling activity on a stream, including the call to incomingData() or incomingMessage(),
+			took longer than the threshold set by setSlowHandlerThreshold(). As the Hub is single-threaded,
+			slow handlers delay all other streams.
+			Not called if the library is built with the DASHEL_STATS CMake option disabled.
+			Subclass can implement this method.
+			Called with the stream lock held.
+
+			\param stream stream whose activity was handled
+			\param duration time spent handling it, in nanoseconds
+		*/
+		virtual void slowHandler(Stream* stream, unsigned long long duration) { /* hook for use by derived classes */ }
 		// clang-format on
 	};
 
@@ -0,0 +1,145 @@
+#include <dashel/dashel.h>
+#include <iostream>
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+using namespace Dashel;
+
+// Count heap allocations through the global allocator, while counting is enabled
+
+static bool countAllocations = false;
+static unsigned long allocationCount = 0;
+
+void* operator new(size_t size)
+{
+	if (countAllocations)
+		++allocationCount;
+	void* p = malloc(size ? size : 1);
+	if (!p)
+		throw bad_alloc();
+	return p;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* p) throw()
+{
+	free(p);
+}
+
+void operator delete[](void* p) throw()
+{
+	free(p);
+}
+
+//! Exchange messages over tcp and udp, echoing each message back to its sender
+class BenchHub : public Hub
+{
+public:
+	BenchHub() :
+		message(),
+		echoed(0)
+	{
+		connect("tcpin:port=8770");
+		tcpClient = connect("tcp:host=localhost;port=8770");
+		udpServer = dynamic_cast<PacketStream*>(connect("udp:port=8771"));
+		udpClient = dynamic_cast<PacketStream*>(connect("udp:port=8772"));
+		// accept the incoming tcp connection
+		step(100);
+	}
+
+	//! Send a message over each transport and step until both echoes came back
+	void exchange()
+	{
+		echoed = 0;
+		tcpClient->write(message, sizeof(message));
+		tcpClient->flush();
+		udpClient->write(message, sizeof(message));
+		udpClient->send(IPV4Address("127.0.0.1", 8771));
+		while (echoed < 2)
+			step(1000);
+	}
+
+protected:
+	Stream* tcpClient;
+	PacketStream* udpServer;
+	PacketStream* udpClient;
+	unsigned char message[256];
+	unsigned char buffer[256];
+	unsigned echoed;
+
+protected:
+	// clang-format off
+	virtual void connectionCreated(Stream* stream) { /* hook for use by derived classes */ }
+	// clang-format on
+
+	void incomingData(Stream* stream)
+	{
+		if (stream == udpServer)
+		{
+			IPV4Address source;
+			udpServer->receive(source);
+			udpServer->read(buffer, sizeof(buffer));
+			udpServer->write(buffer, sizeof(buffer));
+			udpServer->send(source);
+		}
+		else if (stream == udpClient)
+		{
+			IPV4Address source;
+			udpClient->receive(source);
+			udpClient->read(buffer, sizeof(buffer));
+			++echoed;
+		}
+		else if (stream == tcpClient)
+		{
+			stream->read(buffer, sizeof(buffer));
+			++echoed;
+		}
+		else
+		{
+			// the accepted tcp connection
+			stream->read(buffer, sizeof(buffer));
+			stream->write(buffer, sizeof(buffer));
+			stream->flush();
+		}
+	}
+
+	void connectionClosed(Stream* stream, bool abnormal)
+	{
+		cerr << "Connection closed: " << stream->getTargetName() << endl;
+		exit(1);
+	}
+};
+
+int main(int argc, char* argv[])
+{
+	const unsigned warmupRounds = 100;
+	const unsigned rounds = argc > 1 ? atoi(argv[1]) : 10000;
+
+	try
+	{
+		BenchHub hub;
+		for (unsigned i = 0; i < warmupRounds; ++i)
+			hub.exchange();
+
+		countAllocations = true;
+		for (unsigned i = 0; i < rounds; ++i)
+			hub.exchange();
+		countAllocations = false;
+
+		cout << rounds << " rounds, " << allocationCount << " allocations in steady state" << endl;
+		if (allocationCount != 0)
+			return 1;
+	}
+	catch (const DashelException& e)
+	{
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	return 0;
+}
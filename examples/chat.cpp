@@ -53,8 +53,7 @@ protected:
 		line = nick + " : " + line;
 		cout << "* Message from " << line;
 
-		for (StreamsSet::iterator it = dataStreams.begin(); it != dataStreams.end(); ++it)
-			sendString((*it), line);
+		broadcast(SharedBuffer(line.c_str(), line.length()), dataStreams);
 	}
 
 	void connectionClosed(Stream* stream, bool abnormal)
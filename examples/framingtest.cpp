@@ -0,0 +1,127 @@
+#include <dashel/dashel-private.h>
+#include <iostream>
+
+using namespace std;
+using namespace Dashel;
+
+// Check message framing by pushing data in chunks of every size, without opening any stream
+
+static unsigned failureCount = 0;
+
+//! A stream only recording the failures reported by the framer
+class FailureRecorder : public Stream
+{
+public:
+	FailureRecorder() :
+		Stream("test")
+	{
+		throwOnFailure = false;
+	}
+
+	// clang-format off
+	virtual void write(const void* data, const size_t size) { /* nothing to write to */ }
+	virtual void flush() { /* nothing to flush */ }
+	virtual void read(void* data, size_t size) { /* nothing to read from */ }
+	// clang-format on
+};
+
+//! Push data to a framer for target in chunks of chunkSize bytes, return the messages separated by | and the failure reason if any
+static string extract(const char* target, const string& data, size_t chunkSize)
+{
+	ParameterSet parameters;
+	parameters.add(target);
+	MessageFramer* framer(MessageFramer::create(parameters));
+	FailureRecorder stream;
+	string result;
+	for (size_t pos = 0; pos < data.size() && !stream.failed(); pos += chunkSize)
+	{
+		framer->push((const unsigned char*)data.data() + pos, min(chunkSize, data.size() - pos));
+		const unsigned char* message;
+		size_t size;
+		while (framer->next(&stream, message, size))
+			result.append((const char*)message, size).append("|");
+	}
+	delete framer;
+	// the reason is followed by a space and the system error message, which is empty here
+	if (stream.failed())
+		result.append(stream.getFailReason(), 0, stream.getFailReason().find_last_not_of(' ') + 1);
+	return result;
+}
+
+//! Check that framing data according to target yields expected, whatever the sizes of received chunks
+static void check(const char* target, const string& data, const string& expected)
+{
+	for (size_t chunkSize = 1; chunkSize <= data.size(); ++chunkSize)
+	{
+		const string result(extract(target, data, chunkSize));
+		if (result != expected)
+		{
+			cerr << "Failed: " << target << " in chunks of " << chunkSize << " bytes gives \"" << result << "\" instead of \"" << expected << "\"" << endl;
+			++failureCount;
+			return;
+		}
+	}
+}
+
+static void checkLengthPrefixes()
+{
+	check("tcp:framing=u8", string("\x03" "abc" "\x00" "\x02" "de", 8), "abc||de|");
+	check("tcp:framing=u16le", string("\x03\x00" "abc" "\x02\x00" "de", 9), "abc|de|");
+	check("tcp:framing=u16be", string("\x00\x03" "abc", 5), "abc|");
+	check("tcp:framing=u32le", string("\x02\x00\x00\x00" "ab", 6), "ab|");
+	check("tcp:framing=u32be", string("\x00\x00\x00\x02" "ab", 6), "ab|");
+	check("tcp:framing=u8;framingMax=4", string("\x03" "abc" "\x04" "abcd", 9), "abc|Message too large.");
+
+	// header layouts pass the whole frame, split headers must be reassembled
+	check("tcp:framing=u16be;framingHeader=4;framingOffset=1", string("T\x00\x02" "x" "ab" "U\x00\x00" "y", 10), string("T\x00\x02" "xab|U\x00\x00" "y|", 12));
+	check("tcp:framing=u8;framingHeader=2;framingInclusive=true", string("\x04" "xab" "\x02" "y", 6), string("\x04" "xab|\x02" "y|", 8));
+	check("tcp:framing=u8;framingHeader=2;framingInclusive=true", string("\x01" "x", 2), "Message size smaller than its header.");
+}
+
+static void checkVarint()
+{
+	check("tcp:framing=varint", string("\x03" "abc" "\x00", 5), "abc||");
+	const string payload(300, 'p');
+	check("tcp:framing=varint", string("\xac\x02", 2) + payload + string("\x01" "q", 2), payload + "|q|");
+	check("tcp:framing=varint;framingMax=100", string("\xac\x02", 2) + payload, "Message too large.");
+
+	// the tenth byte of a 64-bit length only holds its top bit, and must end the length
+	if (sizeof(size_t) == 8)
+	{
+		check("tcp:framing=varint", string(9, '\x80') + string("\x02", 1), "Invalid variable-length message size.");
+		check("tcp:framing=varint", string(10, '\x80') + string("\x01", 1), "Invalid variable-length message size.");
+		check("tcp:framing=varint", string(9, '\x80') + string("\x01", 1), "Message too large.");
+	}
+}
+
+static void checkDelimiters()
+{
+	check("tcp:framing=line", "one\r\ntwo\n\nthree\n", "one|two||three|");
+	check("tcp:framing=line", "one\ntwo", "one|");
+	check("tcp:framing=delim;framingDelim=0x00", string("ab\0cde\0", 7), "ab|cde|");
+	check("tcp:framing=delim;framingDelim=,", "a,bc,", "a|bc|");
+	check("tcp:framing=line;framingMax=4", "abc\nabcdefgh\n", "abc|Message too large.");
+}
+
+int main()
+{
+	try
+	{
+		checkLengthPrefixes();
+		checkVarint();
+		checkDelimiters();
+	}
+	catch (const DashelException& e)
+	{
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	if (failureCount != 0)
+	{
+		cerr << failureCount << " checks failed" << endl;
+		return 1;
+	}
+	cout << "All framing checks passed" << endl;
+	return 0;
+}
@@ -0,0 +1,142 @@
+#include <dashel/dashel-private.h>
+#include <iostream>
+#include <climits>
+
+using namespace std;
+using namespace Dashel;
+
+// Check the parsing of target parameters, without opening any stream
+
+static unsigned failureCount = 0;
+
+//! Report a failed check
+static void check(bool condition, const char* description)
+{
+	if (!condition)
+	{
+		cerr << "Failed: " << description << endl;
+		++failureCount;
+	}
+}
+
+//! Return whether value parses into T, storing the result in result
+template<typename T>
+static bool parses(const char* value, T& result)
+{
+	return parseParameter(string(value), result);
+}
+
+//! Return whether value is rejected when parsed into T
+template<typename T>
+static bool rejects(const char* value)
+{
+	T result;
+	return !parseParameter(string(value), result);
+}
+
+static void checkBooleans()
+{
+	bool b(false);
+	check(parses("true", b) && b, "true is true");
+	check(parses("false", b) && !b, "false is false");
+	check(parses("1", b) && b, "1 is true");
+	check(parses("0", b) && !b, "0 is false");
+	check(rejects<bool>("yes"), "yes is rejected");
+	check(rejects<bool>(""), "empty boolean is rejected");
+}
+
+static void checkIntegers()
+{
+	int i(0);
+	check(parses("42", i) && i == 42, "42 is an int");
+	check(parses("-17", i) && i == -17, "-17 is an int");
+	check(parses("2147483647", i) && i == INT_MAX, "INT_MAX is an int");
+	check(parses("-2147483648", i) && i == INT_MIN, "INT_MIN is an int");
+	check(rejects<int>("2147483648"), "INT_MAX + 1 overflows an int");
+	check(rejects<int>("-2147483649"), "INT_MIN - 1 overflows an int");
+	check(rejects<int>("99999999999999999999"), "long long overflow is rejected");
+	check(rejects<int>("port"), "a name is not an int");
+	check(rejects<int>(""), "empty int is rejected");
+
+	unsigned u(0);
+	check(parses("4294967295", u) && u == UINT_MAX, "UINT_MAX is an unsigned");
+	check(rejects<unsigned>("4294967296"), "UINT_MAX + 1 overflows an unsigned");
+	check(rejects<unsigned>("-1"), "-1 is not an unsigned");
+	check(rejects<unsigned>(" -1"), "-1 with leading space is not an unsigned");
+
+	unsigned long long ull(0);
+	check(parses("18446744073709551615", ull) && ull == ULLONG_MAX, "ULLONG_MAX is an unsigned long long");
+	check(rejects<unsigned long long>("18446744073709551616"), "ULLONG_MAX + 1 overflows an unsigned long long");
+	check(rejects<unsigned long long>("-1"), "-1 is not an unsigned long long");
+}
+
+static void checkFloatingPoint()
+{
+	double d(0);
+	check(parses("0.5", d) && d == 0.5, "0.5 is a double");
+	check(parses("-2e3", d) && d == -2000, "-2e3 is a double");
+	check(rejects<double>("fast"), "a name is not a double");
+	float f(0);
+	check(parses("0.25", f) && f == 0.25f, "0.25 is a float");
+}
+
+static void checkTargets()
+{
+	ParameterSet target;
+	target.add("tcp:host;port=5000;sock=-1");
+	target.add("tcp:example.com;;5001;framing=u16le");
+	check(target.get("host") == "example.com", "positional host is set");
+	check(target.get<unsigned>("port") == 5001, "positional port overrides the default");
+	check(target.get<int>("sock") == -1, "named default is kept");
+	check(target.get("framing") == "u16le", "named parameter is added");
+	check(!target.isSet("timeout"), "missing parameter is not set");
+	check(target.getString() == "host=example.com;port=5001;sock=-1", "listed parameters are in order");
+
+	bool threw(false);
+	try
+	{
+		target.add("tcp:a;1;2;3");
+	}
+	catch (const DashelException& e)
+	{
+		threw = e.source == DashelException::InvalidTarget;
+	}
+	check(threw, "too many positional parameters are rejected");
+
+	threw = false;
+	try
+	{
+		ParameterSet overflowing;
+		overflowing.add("tcp:port=4294967297");
+		overflowing.get<unsigned>("port");
+	}
+	catch (const DashelException& e)
+	{
+		threw = e.source == DashelException::InvalidTarget;
+	}
+	check(threw, "overflowing port is an invalid target");
+}
+
+int main()
+{
+	try
+	{
+		checkBooleans();
+		checkIntegers();
+		checkFloatingPoint();
+		checkTargets();
+	}
+	catch (const DashelException& e)
+	{
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	if (failureCount != 0)
+	{
+		cerr << failureCount << " checks failed" << endl;
+		return 1;
+	}
+	cout << "All parameter checks passed" << endl;
+	return 0;
+}
@@ -0,0 +1,192 @@
+#include <dashel/dashel.h>
+#include <iostream>
+#include <cstdint>
+#include <string>
+
+using namespace std;
+using namespace Dashel;
+
+// Check StreamWriter and StreamReader through an in-memory stream, without opening any stream of the Hub
+
+static unsigned failureCount = 0;
+
+//! Report a failed check
+static void check(bool condition, const char* description)
+{
+	if (!condition)
+	{
+		cerr << "Failed: " << description << endl;
+		++failureCount;
+	}
+}
+
+//! A stream reading back the data written to it
+class LoopbackStream : public Stream
+{
+public:
+	string data; //!< data written and not read yet
+
+	LoopbackStream() :
+		Stream("loopback") {}
+
+	virtual void write(const void* data, const size_t size) { this->data.append((const char*)data, size); }
+
+	// clang-format off
+	virtual void flush() { /* data are readable as soon as written */ }
+	// clang-format on
+
+	virtual void read(void* data, size_t size)
+	{
+		if (size > this->data.size())
+		{
+			fail(DashelException::ConnectionLost, 0, "Reached end of data.");
+			return;
+		}
+		this->data.copy((char*)data, size);
+		this->data.erase(0, size);
+	}
+};
+
+//! Return whether decoding a value of type T from reader throws a DashelException of source IOError
+template<typename T>
+static bool readThrows(StreamReader& reader)
+{
+	try
+	{
+		reader.read<T>();
+	}
+	catch (const DashelException& e)
+	{
+		return e.source == DashelException::IOError;
+	}
+	return false;
+}
+
+static void checkRoundTrip(ByteOrder order)
+{
+	LoopbackStream stream;
+	StreamWriter writer(&stream, order);
+	const uint16_t shorts[3] = { 0x0102, 0x0304, 0x0506 };
+	const uint32_t ints[2] = { 0x01020304, 0xa0b0c0d0 };
+	const double doubles[2] = { 0.5, -1e300 };
+	writer.write<uint8_t>(0x7f);
+	writer.write<int16_t>(-2);
+	writer.write<uint32_t>(0xdeadbeef);
+	writer.write<uint64_t>(0x0102030405060708ull);
+	writer.write<float>(1.5f);
+	writer.writeArray(shorts, 3);
+	writer.writeArray(ints, 2);
+	writer.writeArray(doubles, 2);
+	writer.writeBytes("xyz", 3);
+	check(writer.size() == 1 + 2 + 4 + 8 + 4 + 6 + 8 + 16 + 3, "writer counts appended bytes");
+	writer.flush();
+	check(writer.size() == 0 && stream.data.size() == 52, "flush writes all data at once");
+
+	StreamReader reader(&stream, order);
+	reader.fill(19);
+	check(reader.read<uint8_t>() == 0x7f, "uint8_t round trip");
+	check(reader.read<int16_t>() == -2, "int16_t round trip");
+	check(reader.read<uint32_t>() == 0xdeadbeef, "uint32_t round trip");
+	check(reader.read<uint64_t>() == 0x0102030405060708ull, "uint64_t round trip");
+	check(reader.read<float>() == 1.5f, "float round trip");
+	check(reader.remaining() == 0, "fill reads the requested size");
+
+	reader.fill(33);
+	uint16_t shortsRead[3];
+	uint32_t intsRead[2];
+	double doublesRead[2];
+	char bytes[3];
+	reader.readArray(shortsRead, 3);
+	reader.readArray(intsRead, 2);
+	reader.readArray(doublesRead, 2);
+	reader.readBytes(bytes, 3);
+	check(shortsRead[0] == shorts[0] && shortsRead[2] == shorts[2], "uint16_t array round trip");
+	check(intsRead[0] == ints[0] && intsRead[1] == ints[1], "uint32_t array round trip");
+	check(doublesRead[0] == doubles[0] && doublesRead[1] == doubles[1], "double array round trip");
+	check(string(bytes, 3) == "xyz", "bytes round trip");
+}
+
+static void checkByteOrder()
+{
+	LoopbackStream stream;
+	StreamWriter writer(&stream, BigEndian);
+	writer.write<uint32_t>(0x01020304);
+	writer.flush();
+	check(stream.data == string("\x01\x02\x03\x04", 4), "big endian puts the most significant byte first");
+
+	const unsigned char little[4] = { 0x04, 0x03, 0x02, 0x01 };
+	StreamReader reader(little, sizeof(little), LittleEndian);
+	check(reader.read<uint32_t>() == 0x01020304, "little endian reads the least significant byte first");
+}
+
+static void checkOverrun()
+{
+	const unsigned char data[3] = { 1, 2, 3 };
+
+	// decoding memory alone only throws
+	StreamReader reader(data, sizeof(data));
+	check(reader.read<uint16_t>() == 0x0201, "reading within the data succeeds");
+	check(readThrows<uint16_t>(reader), "reading past the data throws");
+	check(reader.remaining() == 1, "a failed read consumes nothing");
+	check(reader.read<uint8_t>() == 3, "the data left can still be read");
+
+	// decoding a message fails its stream
+	LoopbackStream stream;
+	StreamReader messageReader(data, sizeof(data), LittleEndian, &stream);
+	check(readThrows<uint32_t>(messageReader), "reading past a message throws");
+	check(stream.failed() && stream.getFailSource() == DashelException::IOError, "reading past a message fails its stream");
+
+	// array sizes in bytes must not overflow
+	StreamReader arrayReader(data, sizeof(data));
+	uint32_t values[1];
+	bool threw(false);
+	try
+	{
+		arrayReader.readArray(values, SIZE_MAX / 2);
+	}
+	catch (const DashelException& e)
+	{
+		threw = e.source == DashelException::IOError;
+	}
+	check(threw, "an array whose size overflows is rejected");
+
+	// fill drops the previous data before reading, so that a failed read leaves nothing to decode
+	LoopbackStream shortStream;
+	shortStream.data = "abcdef";
+	StreamReader fillReader(&shortStream);
+	fillReader.fill(4);
+	threw = false;
+	try
+	{
+		fillReader.fill(4);
+	}
+	catch (const DashelException& e)
+	{
+		threw = e.source == DashelException::ConnectionLost;
+	}
+	check(threw && fillReader.remaining() == 0, "a failed fill leaves nothing to decode");
+}
+
+int main()
+{
+	try
+	{
+		checkRoundTrip(LittleEndian);
+		checkRoundTrip(BigEndian);
+		checkByteOrder();
+		checkOverrun();
+	}
+	catch (const DashelException& e)
+	{
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	if (failureCount != 0)
+	{
+		cerr << failureCount << " checks failed" << endl;
+		return 1;
+	}
+	cout << "All serialization checks passed" << endl;
+	return 0;
+}